@@ -0,0 +1,620 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ *  microbenchmarks of what the page_count vs mapcount COW design costs:
+ *  write fault latency of the COW paths, GUP pin and unpin latency and
+ *  fork latency, to compare kernels with and without a fix.
+ *
+ *  Copyright (C) 2021  Red Hat, Inc.
+ *
+ *  gcc -O2 -o cow_gup_bench cow_gup_bench.c
+ *  ./cow_gup_bench [--bench=write,cow-fork,cow-mprotect,cow-clear_refs,\
+ *	odirect,vmsplice,io_uring,vfio,fork,fork-thp,fork-pinned] \
+ *	[--iterations=N] [--fork-iterations=N] [--fork-size=MiB] \
+ *	[--vfio=<PCI dev>] [<file>]
+ *
+ *  Every selected benchmark (default all) runs on its own and prints
+ *  the percentiles of its latencies in ns, followed by their log2
+ *  histogram:
+ *
+ *	write		write to a page already mapped writable, the
+ *			cost of the timer itself
+ *	cow-fork	first write to each page after fork(), while the
+ *			child still maps them
+ *	cow-mprotect	first write to each page after mprotect(PROT_READ)
+ *			and back to PROT_READ|PROT_WRITE
+ *	cow-clear_refs	first write to each page after writing 4 to
+ *			/proc/self/clear_refs, like page_count_do_wp_page
+ *	odirect		O_DIRECT pread() of one block from <file>, the
+ *			pin, the I/O and the unpin together
+ *	vmsplice	vmsplice() of a page into a pipe (pin) and the
+ *			read() that drains it (unpin)
+ *	io_uring	IORING_REGISTER_BUFFERS (FOLL_LONGTERM pin) and
+ *			IORING_UNREGISTER_BUFFERS of a page
+ *	vfio		VFIO_IOMMU_MAP_DMA and VFIO_IOMMU_UNMAP_DMA of a
+ *			page of --vfio=<PCI dev>
+ *	fork		fork() of a process with --fork-size MiB
+ *			(default 256) of touched anonymous memory
+ *	fork-thp	the same memory backed by THP
+ *	fork-pinned	the same memory registered as io_uring buffers,
+ *			which fork() has to copy
+ *
+ *  The COW and pin benchmarks run --iterations rounds (default 1000),
+ *  the fork ones --fork-iterations (default 50). Benchmarks that cannot
+ *  run on this host (no <file>, no --vfio device, no THP, an
+ *  RLIMIT_MEMLOCK below --fork-size without CAP_IPC_LOCK, ...) are
+ *  reported and skipped. The first output line is the kernel release,
+ *  so runs on different kernels can be told apart.
+ *
+ *  This is caused by the VM design flaw introduced in commit
+ *  09854ba94c6aad7886996bfbee2530b3d8a7f4f4.
+ *
+ *  Fixed in https://gitlab.com/aarcange/aa/-/tree/mapcount_unshare
+ */
+
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+#include <libgen.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <sys/utsname.h>
+#include <sys/resource.h>
+#include <linux/capability.h>
+#include <linux/io_uring.h>
+#include <linux/vfio.h>
+#include "page_count_do_wp_page-common.h"
+
+#define PAGE_SIZE (1UL<<12)
+#define HARDBLKSIZE 512
+/* pages written per round by the COW benchmarks */
+#define COW_PAGES 64
+#define HIST_BUCKETS 40
+
+/* every latency measured, the percentiles are exact */
+struct samples {
+	const char *name;
+	unsigned long *ns;
+	unsigned long nr, max;
+};
+
+static void sample_add(struct samples *s, unsigned long ns)
+{
+	if (s->nr == s->max) {
+		s->max = s->max ? s->max * 2 : 1024;
+		s->ns = realloc(s->ns, s->max * sizeof(*s->ns));
+		if (!s->ns)
+			perror("realloc"), exit(1);
+	}
+	s->ns[s->nr++] = ns;
+}
+
+static int cmp_ulong(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *) a;
+	unsigned long y = *(const unsigned long *) b;
+	return x < y ? -1 : x > y;
+}
+
+static unsigned long percentile(struct samples *s, double pct)
+{
+	unsigned long i = s->nr * pct / 100;
+	return s->ns[i < s->nr ? i : s->nr - 1];
+}
+
+static void samples_report(struct samples *s)
+{
+	if (!s->nr)
+		return;
+	qsort(s->ns, s->nr, sizeof(*s->ns), cmp_ulong);
+	printf("%s: n=%lu min=%lu p50=%lu p90=%lu p99=%lu p99.9=%lu "
+	       "max=%lu\n", s->name, s->nr, s->ns[0], percentile(s, 50),
+	       percentile(s, 90), percentile(s, 99), percentile(s, 99.9),
+	       s->ns[s->nr - 1]);
+
+	unsigned long hist[HIST_BUCKETS] = { 0 }, sum = 0;
+	for (unsigned long i = 0; i < s->nr; i++) {
+		unsigned long ns = s->ns[i];
+		unsigned int bucket = ns ? 64 - __builtin_clzl(ns) : 0;
+		if (bucket >= HIST_BUCKETS)
+			bucket = HIST_BUCKETS - 1;
+		hist[bucket]++;
+	}
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		if (!hist[i])
+			continue;
+		sum += hist[i];
+		printf("\t< %12luns %10lu %6.2f%% %6.2f%%\n", 1UL << i,
+		       hist[i], hist[i] * 100.0 / s->nr, sum * 100.0 / s->nr);
+	}
+	free(s->ns);
+	fflush(stdout);
+}
+
+static unsigned long iterations = 1000, fork_iterations = 50;
+static unsigned long fork_size = 256UL<<20;
+static const char *target_file, *vfio_device;
+
+static char *map_pages(unsigned long size, int advice)
+{
+	char *mem = mmap(NULL, size, PROT_READ|PROT_WRITE,
+			 MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		perror("mmap"), exit(1);
+	if (madvise(mem, size, advice))
+		perror("madvise"), exit(1);
+	return mem;
+}
+
+static void touch_pages(volatile char *mem, unsigned long size)
+{
+	for (unsigned long i = 0; i < size; i += PAGE_SIZE)
+		mem[i] = 1;
+}
+
+static void write_pages(struct samples *s, volatile char *mem)
+{
+	for (unsigned long i = 0; i < COW_PAGES; i++) {
+		unsigned long start = now_ns();
+		mem[i * PAGE_SIZE] = 2;
+		sample_add(s, now_ns() - start);
+	}
+}
+
+static const char *no_setup(void)
+{
+	return NULL;
+}
+
+static void bench_write(struct samples *s)
+{
+	char *mem = map_pages(COW_PAGES * PAGE_SIZE, MADV_NOHUGEPAGE);
+	touch_pages(mem, COW_PAGES * PAGE_SIZE);
+	for (unsigned long n = 0; n < iterations; n++)
+		write_pages(s, mem);
+	munmap(mem, COW_PAGES * PAGE_SIZE);
+}
+
+static void bench_cow_fork(struct samples *s)
+{
+	char *mem = map_pages(COW_PAGES * PAGE_SIZE, MADV_NOHUGEPAGE);
+	for (unsigned long n = 0; n < iterations; n++) {
+		touch_pages(mem, COW_PAGES * PAGE_SIZE);
+		int pipefd[2];
+		if (pipe(pipefd))
+			perror("pipe"), exit(1);
+		pid_t pid = fork();
+		if (pid < 0)
+			perror("fork"), exit(1);
+		if (!pid) {
+			/* keep the pages shared until the parent is done */
+			char c;
+			close(pipefd[1]);
+			if (read(pipefd[0], &c, 1) < 0)
+				_exit(1);
+			_exit(0);
+		}
+		close(pipefd[0]);
+		write_pages(s, mem);
+		close(pipefd[1]);
+		if (waitpid(pid, NULL, 0) < 0)
+			perror("waitpid"), exit(1);
+	}
+	munmap(mem, COW_PAGES * PAGE_SIZE);
+}
+
+static void bench_cow_mprotect(struct samples *s)
+{
+	char *mem = map_pages(COW_PAGES * PAGE_SIZE, MADV_NOHUGEPAGE);
+	touch_pages(mem, COW_PAGES * PAGE_SIZE);
+	for (unsigned long n = 0; n < iterations; n++) {
+		if (mprotect(mem, COW_PAGES * PAGE_SIZE, PROT_READ) ||
+		    mprotect(mem, COW_PAGES * PAGE_SIZE, PROT_READ|PROT_WRITE))
+			perror("mprotect"), exit(1);
+		write_pages(s, mem);
+	}
+	munmap(mem, COW_PAGES * PAGE_SIZE);
+}
+
+static int clear_refs_fd = -1;
+
+static const char *clear_refs_setup(void)
+{
+	clear_refs_fd = open("/proc/self/clear_refs", O_WRONLY);
+	if (clear_refs_fd < 0)
+		return "cannot open /proc/self/clear_refs";
+
+	/* without CONFIG_MEM_SOFT_DIRTY 4 is accepted but does nothing */
+	char *mem = map_pages(PAGE_SIZE, MADV_NOHUGEPAGE);
+	touch_pages(mem, PAGE_SIZE);
+	uint64_t entry = 0;
+	int fd = open("/proc/self/pagemap", O_RDONLY);
+	if (fd >= 0) {
+		if (pread(fd, &entry, sizeof(entry), (unsigned long) mem /
+			  PAGE_SIZE * sizeof(entry)) != sizeof(entry))
+			entry = 0;
+		close(fd);
+	}
+	munmap(mem, PAGE_SIZE);
+	/* a freshly faulted page is soft dirty */
+	if (!(entry & 1ULL << 55))
+		return "soft dirty unsupported";
+	return NULL;
+}
+
+static void bench_cow_clear_refs(struct samples *s)
+{
+	char *mem = map_pages(COW_PAGES * PAGE_SIZE, MADV_NOHUGEPAGE);
+	touch_pages(mem, COW_PAGES * PAGE_SIZE);
+	for (unsigned long n = 0; n < iterations; n++) {
+		if (write(clear_refs_fd, "4", 1) != 1)
+			perror("write clear_refs"), exit(1);
+		write_pages(s, mem);
+	}
+	munmap(mem, COW_PAGES * PAGE_SIZE);
+}
+
+static int target_fd = -1;
+
+static const char *odirect_setup(void)
+{
+	if (!target_file)
+		return "needs <file>";
+	target_fd = open(target_file, O_DIRECT|O_CREAT|O_RDWR|O_TRUNC, 0600);
+	if (target_fd < 0)
+		return "cannot open <file> with O_DIRECT";
+	char *block = map_pages(PAGE_SIZE, MADV_NOHUGEPAGE);
+	if (write(target_fd, block, PAGE_SIZE) != PAGE_SIZE)
+		perror("write"), exit(1);
+	munmap(block, PAGE_SIZE);
+	return NULL;
+}
+
+static void bench_odirect(struct samples *s)
+{
+	char *mem = map_pages(PAGE_SIZE, MADV_NOHUGEPAGE);
+	touch_pages(mem, PAGE_SIZE);
+	for (unsigned long n = 0; n < iterations; n++) {
+		unsigned long start = now_ns();
+		if (pread(target_fd, mem, HARDBLKSIZE, 0) != HARDBLKSIZE)
+			perror("read"), exit(1);
+		sample_add(s, now_ns() - start);
+	}
+	munmap(mem, PAGE_SIZE);
+}
+
+static void bench_vmsplice(struct samples *s)
+{
+	char *mem = map_pages(PAGE_SIZE, MADV_NOHUGEPAGE);
+	char *buf = map_pages(PAGE_SIZE, MADV_NOHUGEPAGE);
+	touch_pages(mem, PAGE_SIZE);
+	int pipefd[2];
+	if (pipe(pipefd))
+		perror("pipe"), exit(1);
+	for (unsigned long n = 0; n < iterations; n++) {
+		struct iovec iov = {
+			.iov_base = mem,
+			.iov_len = PAGE_SIZE,
+		};
+		unsigned long start = now_ns();
+		if (vmsplice(pipefd[1], &iov, 1, 0) != PAGE_SIZE)
+			perror("vmsplice"), exit(1);
+		unsigned long pinned = now_ns();
+		if (read(pipefd[0], buf, PAGE_SIZE) != PAGE_SIZE)
+			perror("read"), exit(1);
+		sample_add(&s[0], pinned - start);
+		sample_add(&s[1], now_ns() - pinned);
+	}
+	close(pipefd[0]);
+	close(pipefd[1]);
+	munmap(mem, PAGE_SIZE);
+	munmap(buf, PAGE_SIZE);
+}
+
+/*
+ * Only the buffer registration is needed, no request is ever queued,
+ * so the ring is set up with the raw syscalls and liburing is not
+ * required.
+ */
+static int ring_fd = -1;
+
+static const char *io_uring_bench_setup(void)
+{
+	/* shared by io_uring and fork-pinned */
+	if (ring_fd >= 0)
+		return NULL;
+	struct io_uring_params params = { 0 };
+	ring_fd = syscall(__NR_io_uring_setup, 1, &params);
+	if (ring_fd < 0)
+		return "io_uring_setup failed";
+	return NULL;
+}
+
+static int io_uring_register(unsigned int opcode, struct iovec *iov,
+			     unsigned int nr)
+{
+	return syscall(__NR_io_uring_register, ring_fd, opcode, iov, nr);
+}
+
+static void bench_io_uring(struct samples *s)
+{
+	char *mem = map_pages(PAGE_SIZE, MADV_NOHUGEPAGE);
+	touch_pages(mem, PAGE_SIZE);
+	struct iovec iov = {
+		.iov_base = mem,
+		.iov_len = PAGE_SIZE,
+	};
+	for (unsigned long n = 0; n < iterations; n++) {
+		unsigned long start = now_ns();
+		if (io_uring_register(IORING_REGISTER_BUFFERS, &iov, 1))
+			perror("IORING_REGISTER_BUFFERS"), exit(1);
+		unsigned long pinned = now_ns();
+		if (io_uring_register(IORING_UNREGISTER_BUFFERS, NULL, 0))
+			perror("IORING_UNREGISTER_BUFFERS"), exit(1);
+		sample_add(&s[0], pinned - start);
+		sample_add(&s[1], now_ns() - pinned);
+	}
+	munmap(mem, PAGE_SIZE);
+}
+
+static int vfio_container = -1;
+
+static const char *vfio_setup(void)
+{
+	const char *err = NULL;
+	if (!vfio_device)
+		return "needs --vfio=<PCI dev>";
+	int group = vfio_get_group(vfio_device);
+	if (group < 0)
+		return "no viable iommu group for the device";
+	vfio_container = open("/dev/vfio/vfio", O_RDWR);
+	if (vfio_container < 0)
+		err = "cannot open /dev/vfio/vfio";
+	else if (ioctl(group, VFIO_GROUP_SET_CONTAINER, &vfio_container))
+		err = "cannot set the group container";
+	else if (ioctl(vfio_container, VFIO_SET_IOMMU, VFIO_TYPE1_IOMMU))
+		err = "cannot set the IOMMU";
+	else if (ioctl(group, VFIO_GROUP_GET_DEVICE_FD, vfio_device) < 0)
+		err = "cannot get the device";
+	if (err) {
+		/* the group keeps the container attached while open */
+		if (vfio_container >= 0)
+			close(vfio_container);
+		vfio_container = -1;
+		close(group);
+	}
+	return err;
+}
+
+static void bench_vfio(struct samples *s)
+{
+	char *mem = map_pages(PAGE_SIZE, MADV_NOHUGEPAGE);
+	touch_pages(mem, PAGE_SIZE);
+	struct vfio_iommu_type1_dma_map dma_map = {
+		.argsz = sizeof(dma_map),
+		.size = PAGE_SIZE,
+		.vaddr = (__u64) mem,
+		.iova = 1<<20,
+		.flags = VFIO_DMA_MAP_FLAG_READ,
+	};
+	for (unsigned long n = 0; n < iterations; n++) {
+		struct vfio_iommu_type1_dma_unmap dma_unmap = {
+			.argsz = sizeof(dma_unmap),
+			.size = PAGE_SIZE,
+			.iova = 1<<20,
+		};
+		unsigned long start = now_ns();
+		if (ioctl(vfio_container, VFIO_IOMMU_MAP_DMA, &dma_map))
+			perror("VFIO_IOMMU_MAP_DMA"), exit(1);
+		unsigned long pinned = now_ns();
+		if (ioctl(vfio_container, VFIO_IOMMU_UNMAP_DMA, &dma_unmap) ||
+		    dma_unmap.size != PAGE_SIZE)
+			perror("VFIO_IOMMU_UNMAP_DMA"), exit(1);
+		sample_add(&s[0], pinned - start);
+		sample_add(&s[1], now_ns() - pinned);
+	}
+	munmap(mem, PAGE_SIZE);
+}
+
+static void fork_loop(struct samples *s)
+{
+	for (unsigned long n = 0; n < fork_iterations; n++) {
+		unsigned long start = now_ns();
+		pid_t pid = fork();
+		if (pid < 0)
+			perror("fork"), exit(1);
+		if (!pid)
+			_exit(0);
+		sample_add(s, now_ns() - start);
+		if (waitpid(pid, NULL, 0) < 0)
+			perror("waitpid"), exit(1);
+	}
+}
+
+static void bench_fork(struct samples *s)
+{
+	char *mem = map_pages(fork_size, MADV_NOHUGEPAGE);
+	touch_pages(mem, fork_size);
+	fork_loop(s);
+	munmap(mem, fork_size);
+}
+
+static const char *thp_setup(void)
+{
+	char buf[128] = "";
+	FILE *file = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+	if (!file)
+		return "no THP";
+	if (!fgets(buf, sizeof(buf), file))
+		buf[0] = 0;
+	fclose(file);
+	if (strstr(buf, "[never]") || !buf[0])
+		return "THP disabled";
+	return NULL;
+}
+
+static void bench_fork_thp(struct samples *s)
+{
+	char *mem = map_pages(fork_size, MADV_HUGEPAGE);
+	touch_pages(mem, fork_size);
+	fork_loop(s);
+	munmap(mem, fork_size);
+}
+
+/* one iovec can register up to 1 GiB */
+#define REGISTER_MAX (1UL<<30)
+
+static bool cap_ipc_lock(void)
+{
+	char line[128];
+	unsigned long long caps = 0;
+	FILE *file = fopen("/proc/self/status", "r");
+	if (!file)
+		return false;
+	while (fgets(line, sizeof(line), file))
+		if (sscanf(line, "CapEff: %llx", &caps) == 1)
+			break;
+	fclose(file);
+	return caps & (1ULL << CAP_IPC_LOCK);
+}
+
+static const char *fork_pinned_setup(void)
+{
+	const char *err = io_uring_bench_setup();
+	if (err)
+		return err;
+	/* RLIMIT_MEMLOCK applies without CAP_IPC_LOCK */
+	struct rlimit rlim;
+	if (getrlimit(RLIMIT_MEMLOCK, &rlim))
+		perror("getrlimit"), exit(1);
+	if (rlim.rlim_cur != RLIM_INFINITY && rlim.rlim_cur < fork_size &&
+	    !cap_ipc_lock())
+		return "RLIMIT_MEMLOCK below --fork-size";
+	return NULL;
+}
+
+static void bench_fork_pinned(struct samples *s)
+{
+	char *mem = map_pages(fork_size, MADV_NOHUGEPAGE);
+	touch_pages(mem, fork_size);
+	unsigned int nr = (fork_size + REGISTER_MAX - 1) / REGISTER_MAX;
+	struct iovec *iov = calloc(nr, sizeof(*iov));
+	if (!iov)
+		perror("calloc"), exit(1);
+	for (unsigned int i = 0; i < nr; i++) {
+		iov[i].iov_base = mem + i * REGISTER_MAX;
+		iov[i].iov_len = fork_size - i * REGISTER_MAX;
+		if (iov[i].iov_len > REGISTER_MAX)
+			iov[i].iov_len = REGISTER_MAX;
+	}
+	if (io_uring_register(IORING_REGISTER_BUFFERS, iov, nr))
+		perror("IORING_REGISTER_BUFFERS"), exit(1);
+	fork_loop(s);
+	if (io_uring_register(IORING_UNREGISTER_BUFFERS, NULL, 0))
+		perror("IORING_UNREGISTER_BUFFERS"), exit(1);
+	free(iov);
+	munmap(mem, fork_size);
+}
+
+struct bench {
+	const char *name;
+	/* returns why the benchmark cannot run, or NULL */
+	const char *(*setup)(void);
+	void (*run)(struct samples *);
+	/* one series, or the pin and the unpin ones */
+	const char *series[2];
+};
+
+static const struct bench benches[] = {
+	{ "write", no_setup, bench_write, { "write" } },
+	{ "cow-fork", no_setup, bench_cow_fork, { "cow-fork" } },
+	{ "cow-mprotect", no_setup, bench_cow_mprotect, { "cow-mprotect" } },
+	{ "cow-clear_refs", clear_refs_setup, bench_cow_clear_refs,
+	  { "cow-clear_refs" } },
+	{ "odirect", odirect_setup, bench_odirect, { "odirect-read" } },
+	{ "vmsplice", no_setup, bench_vmsplice,
+	  { "vmsplice-pin", "vmsplice-unpin" } },
+	{ "io_uring", io_uring_bench_setup, bench_io_uring,
+	  { "io_uring-register", "io_uring-unregister" } },
+	{ "vfio", vfio_setup, bench_vfio, { "vfio-map", "vfio-unmap" } },
+	{ "fork", no_setup, bench_fork, { "fork" } },
+	{ "fork-thp", thp_setup, bench_fork_thp, { "fork-thp" } },
+	{ "fork-pinned", fork_pinned_setup, bench_fork_pinned,
+	  { "fork-pinned" } },
+};
+
+#define NR_BENCHES (sizeof(benches) / sizeof(benches[0]))
+
+static int bench_lookup(const char *name)
+{
+	for (unsigned int i = 0; i < NR_BENCHES; i++)
+		if (!strcmp(benches[i].name, name))
+			return i;
+	return -1;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long bench_mask = (1UL << NR_BENCHES) - 1;
+	bool usage = false;
+	for (int i = 1; i < argc; i++) {
+		if (!strncmp(argv[i], "--bench=", 8))
+			usage |= !parse_list(argv[i] + 8, bench_lookup,
+					     &bench_mask);
+		else if (!strncmp(argv[i], "--iterations=", 13)) {
+			iterations = strtoul(argv[i] + 13, NULL, 0);
+			usage |= !iterations;
+		} else if (!strncmp(argv[i], "--fork-iterations=", 18)) {
+			fork_iterations = strtoul(argv[i] + 18, NULL, 0);
+			usage |= !fork_iterations;
+		} else if (!strncmp(argv[i], "--fork-size=", 12)) {
+			fork_size = strtoul(argv[i] + 12, NULL, 0) << 20;
+			usage |= !fork_size;
+		} else if (!strncmp(argv[i], "--vfio=", 7))
+			vfio_device = argv[i] + 7;
+		else if (!target_file && strncmp(argv[i], "--", 2))
+			target_file = argv[i];
+		else
+			usage = true;
+	}
+	if (usage)
+		printf("%s [--bench=write,cow-fork,cow-mprotect,cow-clear_refs,"
+		       "odirect,vmsplice,io_uring,vfio,fork,fork-thp,"
+		       "fork-pinned] [--iterations=N] [--fork-iterations=N] "
+		       "[--fork-size=MiB] [--vfio=<PCI dev>] [<file>]\n",
+		       argv[0]), exit(1);
+
+	struct utsname uts;
+	if (uname(&uts))
+		perror("uname"), exit(1);
+	printf("kernel %s\n", uts.release);
+
+	for (unsigned int i = 0; i < NR_BENCHES; i++) {
+		const struct bench *bench = &benches[i];
+		if (!(bench_mask & (1UL << i)))
+			continue;
+		const char *err = bench->setup();
+		if (err) {
+			printf("%s: skipped: %s\n", bench->name, err);
+			continue;
+		}
+		struct samples s[2] = {
+			{ .name = bench->series[0] },
+			{ .name = bench->series[1] },
+		};
+		bench->run(s);
+		samples_report(&s[0]);
+		samples_report(&s[1]);
+	}
+	return 0;
+}
@@ -0,0 +1,992 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ *  single driver for the page_count instead of mapcount in do_wp_page
+ *  reproducers, with pluggable GUP pin backends and perturbers.
+ *
+ *  Copyright (C) 2021  Red Hat, Inc.
+ *
+ *  gcc -O2 -o gup_pin_driver gup_pin_driver.c -lpthread \
+ *	[-DHAVE_LIBURING -luring]
+ *  ./gup_pin_driver [--backend=odirect,io_uring,vmsplice,vfio] \
+ *	[--perturber=clear_refs,pageout,swap,migrate,ksm,compact,collapse] \
+ *	[--rate=<perturber>:N] [--vfio=<PCI dev>] [--cgroup[=MiB]] \
+ *	[--interval=SEC] [<file>]
+ *
+ *  Every selected backend (default all) runs its own pin loop on its
+ *  own page triplet, with its own writer thread, all at the same time:
+ *
+ *	odirect		O_DIRECT read from <file>
+ *	io_uring	read into a fixed buffer registered with
+ *			io_uring_register_buffers, built only with
+ *			-DHAVE_LIBURING (link with -luring)
+ *	vmsplice	vmsplice into a pipe, then write the page and
+ *			check the pipe still sees it
+ *	vfio		VFIO_IOMMU_MAP_DMA of the page, the COW can only
+ *			be seen with page_count_do_wp_page-tracer
+ *
+ *  Backends that cannot run on this host (no <file>, no liburing, no
+ *  --vfio device, ...) are reported and skipped. The selected
+ *  perturbers (default clear_refs,pageout) run once for all backends:
+ *
+ *	clear_refs	writes 4 to /proc/self/clear_refs in a loop
+ *	pageout		MADV_PAGEOUT of every race page at random
+ *			intervals
+ *	swap		rotates a region larger than the available
+ *			memory through re-touch, MADV_COLD and
+ *			MADV_PAGEOUT, needs swap
+ *	migrate		move_pages() of the race pages to the next NUMA
+ *			node, with a migrate_pages() of the whole
+ *			process every 64 runs, needs two NUMA nodes
+ *	ksm		MADV_MERGEABLE of every race triplet with the
+ *			KSM scanner tuned to run every millisecond,
+ *			re-queued by MADV_UNMERGEABLE, needs root
+ *	compact		writes 1 to /proc/sys/vm/compact_memory,
+ *			needs root
+ *	collapse	MADV_COLLAPSE of the PMD aligned window around
+ *			every race triplet, split again right away
+ *
+ *  Without --rate a perturber waits a random delay between two runs
+ *  (none for clear_refs and swap, up to 1ms for pageout and migrate,
+ *  10ms for ksm and collapse, 100ms for compact). --rate=<perturber>:N
+ *  runs it N times per second instead, or back to back with N=0, and
+ *  can be repeated for every perturber. The swap perturber counts one
+ *  run per 2 MiB chunk step. The KSM tunables are restored at exit.
+ *
+ *  --cgroup confines the driver in its own cgroup v2 with a
+ *  memory.max of MiB (default 256) and sizes the swap perturber to
+ *  twice that, instead of swapping the whole host. It requires root
+ *  and the cgroup v2 hierarchy mounted at /sys/fs/cgroup.
+ *
+ *  Every --interval seconds (default 1) the attempts, the attempt rate
+ *  and the detections of every backend are printed on one line,
+ *  followed by the MiB/s pushed out by the swap perturber and by the
+ *  runs per second of every perturber.
+ *
+ *  This is caused by the VM design flaw introduced in commit
+ *  09854ba94c6aad7886996bfbee2530b3d8a7f4f4.
+ *
+ *  Fixed in https://gitlab.com/aarcange/aa/-/tree/mapcount_unshare
+ */
+
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <signal.h>
+#include <errno.h>
+#include <limits.h>
+#include <libgen.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <linux/vfio.h>
+#include <linux/mempolicy.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+#include "page_count_do_wp_page-common.h"
+
+#define PAGE_SIZE (1UL<<12)
+/*
+ * NOTE: an arch with a PAGE_SIZE > 4k will reproduce the silent mm
+ * corruption with an HARDBLKSIZE of 4k or more.
+ */
+#define HARDBLKSIZE 512
+#define CGROUP_DEFAULT_MAX (256UL<<20)
+#define PMD_SIZE (1UL<<21)
+#ifndef MADV_COLLAPSE
+#define MADV_COLLAPSE 25
+#endif
+/*
+ * One race per backend. The race page is followed by its expected
+ * content after the pin (zeroes) and by its content before the pin
+ * (0xff), like in page_count_do_wp_page-swap.
+ */
+struct race {
+	const struct pin_backend *backend;
+	char *mem;
+	void *priv;
+	bool skip_memset;
+	/* written only by the race thread, sampled by the reporter */
+	unsigned long attempts;
+	unsigned long detections;
+};
+
+struct pin_backend {
+	const char *name;
+	/* returns why the backend cannot run, or NULL */
+	const char *(*setup)(struct race *race);
+	/* one pin, write and unpin cycle on the race page */
+	void (*cycle)(struct race *race);
+};
+
+static char *target_file, *vfio_device;
+
+static void race_detected(struct race *race)
+{
+	__atomic_store_n(&race->detections, race->detections + 1,
+			 __ATOMIC_RELAXED);
+}
+
+/* check a page read by the pin, then alternate the pre-read content */
+static void race_check(struct race *race)
+{
+	char *mem = race->mem;
+	if (memcmp(mem, mem+PAGE_SIZE, HARDBLKSIZE)) {
+		race_detected(race);
+		if (memcmp(mem, mem+PAGE_SIZE*2, PAGE_SIZE)) {
+			if (race->skip_memset)
+				printf("%s: unexpected memory "
+				       "corruption detected\n",
+				       race->backend->name);
+			else
+				printf("%s: memory corruption detected, "
+				       "dumping page\n", race->backend->name);
+			int end = PAGE_SIZE;
+			if (!memcmp(mem+HARDBLKSIZE, mem+PAGE_SIZE,
+				    PAGE_SIZE-HARDBLKSIZE))
+				end = HARDBLKSIZE;
+			for (int i = 0; i < end; i++)
+				printf("%x", mem[i]);
+			printf("\n");
+		} else
+			printf("%s: memory corruption detected\n",
+			       race->backend->name);
+		fflush(stdout);
+	}
+	race->skip_memset = !race->skip_memset;
+	if (!race->skip_memset)
+		memset(mem, 0xff, HARDBLKSIZE);
+}
+
+/* the file read by the O_DIRECT and io_uring backends, opened once */
+static int target_fd = -1;
+
+static const char *target_open(void)
+{
+	if (target_fd >= 0)
+		return NULL;
+	if (!target_file)
+		return "needs <file>";
+	int fd = open(target_file, O_DIRECT|O_CREAT|O_RDWR|O_TRUNC, 0600);
+	if (fd < 0)
+		return "cannot open <file> with O_DIRECT";
+	static char zero[PAGE_SIZE] __attribute__((aligned(PAGE_SIZE)));
+	if (write(fd, zero, PAGE_SIZE) != PAGE_SIZE) {
+		close(fd);
+		return "cannot write <file>";
+	}
+	target_fd = fd;
+	return NULL;
+}
+
+static const char *odirect_setup(struct race *race)
+{
+	return target_open();
+}
+
+static void odirect_cycle(struct race *race)
+{
+	if (pread(target_fd, race->mem, HARDBLKSIZE, 0) != HARDBLKSIZE)
+		perror("read"), exit(1);
+	race_check(race);
+}
+
+#ifdef HAVE_LIBURING
+static const char *uring_backend_setup(struct race *race)
+{
+	const char *err = target_open();
+	if (err)
+		return err;
+	struct io_uring *ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		perror("calloc"), exit(1);
+	if (io_uring_queue_init(1, ring, 0) < 0) {
+		free(ring);
+		return "io_uring_queue_init failed";
+	}
+	race->priv = ring;
+	return NULL;
+}
+
+static void uring_backend_cycle(struct race *race)
+{
+	struct io_uring *ring = race->priv;
+	struct io_uring_cqe *cqe;
+	struct io_uring_sqe *sqe;
+	struct iovec iov = {
+		.iov_base = race->mem,
+		.iov_len = HARDBLKSIZE,
+	};
+	int ret;
+
+	/* FOLL_PIN | FOLL_LONGTERM the race page until unregistered */
+	ret = io_uring_register_buffers(ring, &iov, 1);
+	if (ret)
+		fprintf(stderr, "io_uring_register_buffers() failed: %d\n",
+			ret), exit(1);
+
+	/* any wrong COW in the meantime will see stale data */
+	random_delay_us(1000);
+
+	sqe = io_uring_get_sqe(ring);
+	if (!sqe)
+		fprintf(stderr, "io_uring_get_sqe() failed\n"), exit(1);
+	io_uring_prep_read_fixed(sqe, target_fd, race->mem, HARDBLKSIZE, 0, 0);
+	ret = io_uring_submit(ring);
+	if (ret < 0)
+		fprintf(stderr, "io_uring_submit() failed: %d\n", ret), exit(1);
+	ret = io_uring_wait_cqe(ring, &cqe);
+	if (ret < 0)
+		fprintf(stderr, "io_uring_wait_cqe() failed: %d\n", ret),
+			exit(1);
+	if (cqe->res != HARDBLKSIZE)
+		fprintf(stderr, "io_uring read failed: %d\n", cqe->res),
+			exit(1);
+	io_uring_cqe_seen(ring, cqe);
+
+	ret = io_uring_unregister_buffers(ring);
+	if (ret)
+		fprintf(stderr, "io_uring_unregister_buffers() failed: %d\n",
+			ret), exit(1);
+	race_check(race);
+}
+#else
+static const char *uring_backend_setup(struct race *race)
+{
+	return "built without liburing";
+}
+
+static void uring_backend_cycle(struct race *race)
+{
+}
+#endif
+
+static const char *vmsplice_setup(struct race *race)
+{
+	int *pipe_fds = calloc(2, sizeof(*pipe_fds));
+	if (!pipe_fds)
+		perror("calloc"), exit(1);
+	if (pipe(pipe_fds)) {
+		free(pipe_fds);
+		return "pipe failed";
+	}
+	race->priv = pipe_fds;
+	return NULL;
+}
+
+/*
+ * The pipe holds a pin on the race page until it is read. The page is
+ * written after the vmsplice, so the pipe must return the new content:
+ * the old one means the write was redirected to a COW copy.
+ */
+static void vmsplice_cycle(struct race *race)
+{
+	int *pipe_fds = race->priv;
+	char buf[HARDBLKSIZE];
+	unsigned char seq = race->attempts << 1;
+	struct iovec iov = {
+		.iov_base = race->mem,
+		.iov_len = HARDBLKSIZE,
+	};
+
+	memset(race->mem, seq, HARDBLKSIZE);
+	if (vmsplice(pipe_fds[1], &iov, 1, 0) != HARDBLKSIZE)
+		perror("vmsplice"), exit(1);
+	random_delay_us(1000);
+	memset(race->mem, seq + 1, HARDBLKSIZE);
+	if (read(pipe_fds[0], buf, HARDBLKSIZE) != HARDBLKSIZE)
+		perror("read pipe"), exit(1);
+	if (memcmp(buf, race->mem, HARDBLKSIZE)) {
+		race_detected(race);
+		printf("%s: memory corruption detected, pipe %x page %x\n",
+		       race->backend->name, (unsigned char) buf[0],
+		       (unsigned char) race->mem[0]);
+		fflush(stdout);
+	}
+}
+
+struct vfio {
+	int container;
+	int group;
+	int device;
+};
+
+static const char *vfio_setup(struct race *race)
+{
+	if (!vfio_device)
+		return "needs --vfio=<PCI dev>";
+	const char *err = NULL;
+	struct vfio *vfio = calloc(1, sizeof(*vfio));
+	if (!vfio)
+		perror("calloc"), exit(1);
+	vfio->group = vfio_get_group(vfio_device);
+	if (vfio->group < 0) {
+		free(vfio);
+		return "no viable iommu group for the device";
+	}
+	vfio->container = open("/dev/vfio/vfio", O_RDWR);
+	if (vfio->container < 0)
+		err = "cannot open /dev/vfio/vfio";
+	else if (ioctl(vfio->group, VFIO_GROUP_SET_CONTAINER,
+		       &vfio->container))
+		err = "cannot set the group container";
+	else if (ioctl(vfio->container, VFIO_SET_IOMMU, VFIO_TYPE1_IOMMU))
+		err = "cannot set the IOMMU";
+	else if ((vfio->device = ioctl(vfio->group, VFIO_GROUP_GET_DEVICE_FD,
+				       vfio_device)) < 0)
+		err = "cannot get the device";
+	if (err) {
+		if (vfio->container >= 0)
+			close(vfio->container);
+		close(vfio->group);
+		free(vfio);
+		return err;
+	}
+	race->priv = vfio;
+	printf("vfio: detections need page_count_do_wp_page-tracer\n");
+	return NULL;
+}
+
+static void vfio_cycle(struct race *race)
+{
+	struct vfio *vfio = race->priv;
+	volatile char *mem = race->mem;
+	struct vfio_iommu_type1_dma_map dma_map = {
+		.argsz = sizeof(dma_map),
+		.size = PAGE_SIZE,
+		.vaddr = (__u64) race->mem,
+		.iova = 1<<20,
+		.flags = VFIO_DMA_MAP_FLAG_READ,
+	};
+	struct vfio_iommu_type1_dma_unmap dma_unmap = {
+		.argsz = sizeof(dma_unmap),
+		.size = PAGE_SIZE,
+		.iova = 1<<20,
+	};
+
+	random_delay_us(1000);
+	char x = mem[PAGE_SIZE-1];
+	if (ioctl(vfio->container, VFIO_IOMMU_MAP_DMA, &dma_map))
+		perror("VFIO_IOMMU_MAP_DMA"), exit(1);
+	mem[PAGE_SIZE-1] = x;
+	if (ioctl(vfio->container, VFIO_IOMMU_UNMAP_DMA, &dma_unmap) ||
+	    dma_unmap.size != PAGE_SIZE)
+		perror("VFIO_IOMMU_UNMAP_DMA"), exit(1);
+}
+
+static const struct pin_backend backends[] = {
+	{ "odirect", odirect_setup, odirect_cycle },
+	{ "io_uring", uring_backend_setup, uring_backend_cycle },
+	{ "vmsplice", vmsplice_setup, vmsplice_cycle },
+	{ "vfio", vfio_setup, vfio_cycle },
+};
+
+#define NR_BACKENDS (sizeof(backends) / sizeof(backends[0]))
+
+static struct race races[NR_BACKENDS];
+static unsigned int nr_races;
+
+/*
+ * Every race triplet sits at the start of its own PMD aligned window,
+ * so the collapse perturber can turn it into a THP. The window has
+ * MADV_NOHUGEPAGE set otherwise.
+ */
+static char *race_alloc(void)
+{
+	char *map = mmap(NULL, PMD_SIZE * 2, PROT_READ|PROT_WRITE,
+			 MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED)
+		perror("mmap"), exit(1);
+	char *window = (char *)(((unsigned long) map + PMD_SIZE - 1) &
+				~(PMD_SIZE - 1));
+	if (window > map)
+		munmap(map, window - map);
+	munmap(window + PMD_SIZE, map + PMD_SIZE - window);
+	/* THP is not using page_count so it would not corrupt memory */
+	if (madvise(window, PMD_SIZE, MADV_NOHUGEPAGE))
+		perror("madvise"), exit(1);
+	return window;
+}
+
+static void* race_loop(void *_race)
+{
+	struct race *race = _race;
+	for (;;) {
+		race->backend->cycle(race);
+		__atomic_store_n(&race->attempts, race->attempts + 1,
+				 __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+static void* writer(void *_race)
+{
+	struct race *race = _race;
+	volatile char *mem = race->mem;
+	char x;
+	for(;;) {
+		random_delay_us(1000);
+		x = mem[PAGE_SIZE-1];
+		mem[PAGE_SIZE-1] = x;
+	}
+	return NULL;
+}
+
+static int clear_refs_fd;
+
+/*
+ * Every perturber thread runs at its own pace. --rate=<perturber>:N
+ * runs it N times per second against absolute deadlines, or as fast
+ * as it can with N=0; without --rate it waits a random delay of up to
+ * default_us between two runs. The runs are counted for the reporter.
+ */
+struct perturber_state {
+	/* calls per second, -1 for the default random delay */
+	long rate;
+	unsigned long default_us;
+	unsigned long next;
+	bool running;
+	/* written only by the perturber, sampled by the reporter */
+	unsigned long ops;
+};
+
+static void perturber_pace(struct perturber_state *state)
+{
+	if (state->rate < 0) {
+		if (state->default_us)
+			random_delay_us(state->default_us);
+		return;
+	}
+	if (!state->rate)
+		return;
+	unsigned long now = now_ns();
+	if (!state->next)
+		state->next = now;
+	state->next += 1000000000UL / state->rate;
+	if (state->next > now)
+		delay_ns(state->next - now);
+	else
+		state->next = now;
+}
+
+static inline void perturber_done(struct perturber_state *state)
+{
+	__atomic_store_n(&state->ops, state->ops + 1, __ATOMIC_RELAXED);
+}
+
+static const char *clear_refs_setup(void)
+{
+	clear_refs_fd = open("/proc/self/clear_refs", O_WRONLY);
+	if (clear_refs_fd < 0)
+		return "cannot open /proc/self/clear_refs";
+	return NULL;
+}
+
+static void* background_soft_dirty(void *data)
+{
+	struct perturber_state *state = data;
+	for (;;) {
+		perturber_pace(state);
+		if (write(clear_refs_fd, "4", 1) != 1)
+			perror("write soft dirty"), exit(1);
+		perturber_done(state);
+	}
+	return NULL;
+}
+
+static const char *pageout_setup(void)
+{
+	/* MADV_PAGEOUT requires v5.4 */
+	if (madvise(races[0].mem, PAGE_SIZE, MADV_PAGEOUT))
+		return "MADV_PAGEOUT unsupported";
+	return NULL;
+}
+
+static void* background_pageout(void *data)
+{
+	struct perturber_state *state = data;
+	for(;;) {
+		perturber_pace(state);
+		for (unsigned int i = 0; i < nr_races; i++)
+			madvise(races[i].mem, PAGE_SIZE, MADV_PAGEOUT);
+		perturber_done(state);
+	}
+	return NULL;
+}
+
+static unsigned long cgroup_max, swap_size;
+
+static const char *swap_setup(void)
+{
+	struct meminfo mi;
+	if (!meminfo_read(&mi))
+		return "cannot parse /proc/meminfo";
+	if (!mi.swap_total || !mi.swap_free)
+		return "not enough swap";
+	swap_size = (mi.swap_free * 3 / 4 + mi.mem_free) * 1024;
+	if (cgroup_max) {
+		/* twice memory.max keeps reclaim busy inside the cgroup */
+		swap_size = cgroup_max * 2;
+		if (mi.swap_free * 1024 < swap_size - cgroup_max)
+			return "not enough swap";
+	}
+	printf("Will allocate %lu MiB in order to swap\n",
+	       swap_size / 1024 / 1024);
+	return NULL;
+}
+
+/* pages pushed out by the churn engine, sampled by the reporter */
+static unsigned long swap_churned;
+static bool swap_churning;
+
+/* one run is one chunk step of the churn engine */
+static void* background_swap(void *data)
+{
+	struct perturber_state *state = data;
+	struct swap_churn churn;
+	churn_init(&churn, swap_size);
+	__atomic_store_n(&swap_churning, true, __ATOMIC_RELAXED);
+	for (;;) {
+		perturber_pace(state);
+		unsigned long pushed = churn_step(&churn);
+		__atomic_store_n(&swap_churned,
+				 swap_churned + pushed / PAGE_SIZE,
+				 __ATOMIC_RELAXED);
+		perturber_done(state);
+	}
+	return NULL;
+}
+
+/*
+ * Migration moves every race page to the next NUMA node in turn with
+ * move_pages(), and every MIGRATE_PROCESS_EVERY runs the whole process
+ * with migrate_pages(), so both the per-page and the per-mm walks see
+ * the pins.
+ */
+#define MIGRATE_PROCESS_EVERY 64
+#define MAX_NUMA_NODES 64
+
+static int numa_nodes[MAX_NUMA_NODES];
+static unsigned int nr_numa_nodes;
+
+static const char *migrate_setup(void)
+{
+	FILE *file = fopen("/sys/devices/system/node/online", "r");
+	if (!file)
+		return "cannot open /sys/devices/system/node/online";
+	char *line = NULL, *save, *tok;
+	size_t len = 0;
+	nr_numa_nodes = 0;
+	if (getline(&line, &len, file) > 0)
+		/* a list of ranges like 0-3,8 */
+		for (tok = strtok_r(line, ",\n", &save); tok;
+		     tok = strtok_r(NULL, ",\n", &save)) {
+			int first, last;
+			int ret = sscanf(tok, "%d-%d", &first, &last);
+			if (ret < 1)
+				break;
+			if (ret < 2)
+				last = first;
+			for (int node = first; node <= last &&
+				     node < MAX_NUMA_NODES; node++)
+				numa_nodes[nr_numa_nodes++] = node;
+		}
+	free(line);
+	fclose(file);
+	if (nr_numa_nodes < 2)
+		return "needs two NUMA nodes";
+	return NULL;
+}
+
+static void* background_migrate(void *data)
+{
+	struct perturber_state *state = data;
+	void *pages[NR_BACKENDS];
+	int nodes[NR_BACKENDS], status[NR_BACKENDS];
+	unsigned long all_nodes = 0;
+	for (unsigned int i = 0; i < nr_numa_nodes; i++)
+		all_nodes |= 1UL << numa_nodes[i];
+	for (unsigned long tick = 0;; tick++) {
+		int node = numa_nodes[tick % nr_numa_nodes];
+		perturber_pace(state);
+		if (tick % MIGRATE_PROCESS_EVERY) {
+			for (unsigned int i = 0; i < nr_races; i++) {
+				pages[i] = races[i].mem;
+				nodes[i] = node;
+			}
+			if (syscall(SYS_move_pages, 0, nr_races, pages, nodes,
+				    status, MPOL_MF_MOVE) < 0)
+				perror("move_pages"), exit(1);
+		} else {
+			unsigned long to = 1UL << node;
+			if (syscall(SYS_migrate_pages, 0, MAX_NUMA_NODES,
+				    &all_nodes, &to) < 0)
+				perror("migrate_pages"), exit(1);
+		}
+		perturber_done(state);
+	}
+	return NULL;
+}
+
+/*
+ * KSM merges the race pages, which all have the same content, and
+ * the writers break the merges with a COW. The scanner is tuned to
+ * look at the race pages often and its tunables are restored at exit.
+ */
+#define KSM_DIR "/sys/kernel/mm/ksm/"
+
+static const struct {
+	const char *file;
+	const char *val;
+} ksm_tunables[] = {
+	{ KSM_DIR "run", "1" },
+	{ KSM_DIR "sleep_millisecs", "1" },
+	{ KSM_DIR "pages_to_scan", "100" },
+};
+
+#define NR_KSM_TUNABLES (sizeof(ksm_tunables) / sizeof(ksm_tunables[0]))
+
+static char ksm_saved[NR_KSM_TUNABLES][32];
+
+static int ksm_read(const char *file, char *buf, size_t size)
+{
+	int fd = open(file, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	ssize_t ret = read(fd, buf, size - 1);
+	close(fd);
+	if (ret <= 0)
+		return -1;
+	buf[ret] = 0;
+	buf[strcspn(buf, "\n")] = 0;
+	return 0;
+}
+
+static int ksm_write(const char *file, const char *val)
+{
+	int fd = open(file, O_WRONLY);
+	if (fd < 0)
+		return -1;
+	ssize_t ret = write(fd, val, strlen(val));
+	close(fd);
+	return ret == (ssize_t) strlen(val) ? 0 : -1;
+}
+
+/* async-signal-safe, it runs from ksm_exit_signal() too */
+static void ksm_restore(void)
+{
+	for (unsigned int i = 0; i < NR_KSM_TUNABLES; i++)
+		if (ksm_saved[i][0])
+			ksm_write(ksm_tunables[i].file, ksm_saved[i]);
+}
+
+static void ksm_exit_signal(int sig)
+{
+	ksm_restore();
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+static const char *ksm_setup(void)
+{
+	for (unsigned int i = 0; i < NR_KSM_TUNABLES; i++)
+		if (ksm_read(ksm_tunables[i].file, ksm_saved[i],
+			     sizeof(ksm_saved[i])))
+			return "cannot read " KSM_DIR;
+	atexit(ksm_restore);
+	signal(SIGINT, ksm_exit_signal);
+	signal(SIGTERM, ksm_exit_signal);
+	for (unsigned int i = 0; i < NR_KSM_TUNABLES; i++)
+		if (ksm_write(ksm_tunables[i].file, ksm_tunables[i].val))
+			return "cannot tune KSM (needs root)";
+	for (unsigned int i = 0; i < nr_races; i++)
+		if (madvise(races[i].mem, PAGE_SIZE*3, MADV_MERGEABLE))
+			return "MADV_MERGEABLE unsupported";
+	return NULL;
+}
+
+static void* background_ksm(void *data)
+{
+	struct perturber_state *state = data;
+	for (;;) {
+		perturber_pace(state);
+		/* unmerge and queue the race pages again */
+		for (unsigned int i = 0; i < nr_races; i++) {
+			madvise(races[i].mem, PAGE_SIZE*3, MADV_UNMERGEABLE);
+			madvise(races[i].mem, PAGE_SIZE*3, MADV_MERGEABLE);
+		}
+		perturber_done(state);
+	}
+	return NULL;
+}
+
+static int compact_fd;
+
+static const char *compact_setup(void)
+{
+	compact_fd = open("/proc/sys/vm/compact_memory", O_WRONLY);
+	if (compact_fd < 0)
+		return "cannot open /proc/sys/vm/compact_memory (needs root)";
+	return NULL;
+}
+
+static void* background_compact(void *data)
+{
+	struct perturber_state *state = data;
+	for (;;) {
+		perturber_pace(state);
+		if (write(compact_fd, "1", 1) != 1)
+			perror("write compact_memory"), exit(1);
+		perturber_done(state);
+	}
+	return NULL;
+}
+
+/*
+ * MADV_COLLAPSE copies the race triplet into a THP like khugepaged
+ * would, which fails while a pin holds an extra reference. THP does
+ * not use page_count in the COW, so the huge pmd is split again right
+ * away by zapping the rest of the window.
+ */
+static const char *collapse_setup(void)
+{
+	char *window = race_alloc();
+	bool unsupported;
+	window[0] = 0;
+	/* MADV_COLLAPSE requires v6.1, EAGAIN or ENOMEM may be transient */
+	unsupported = madvise(window, PMD_SIZE, MADV_HUGEPAGE) ||
+		(madvise(window, PMD_SIZE, MADV_COLLAPSE) && errno == EINVAL);
+	munmap(window, PMD_SIZE);
+	if (unsupported)
+		return "MADV_COLLAPSE unsupported or THP disabled";
+	return NULL;
+}
+
+static void* background_collapse(void *data)
+{
+	struct perturber_state *state = data;
+	for (;;) {
+		perturber_pace(state);
+		for (unsigned int i = 0; i < nr_races; i++) {
+			char *window = races[i].mem;
+			madvise(window, PMD_SIZE, MADV_HUGEPAGE);
+			madvise(window, PMD_SIZE, MADV_COLLAPSE);
+			madvise(window, PMD_SIZE, MADV_NOHUGEPAGE);
+			madvise(window + PAGE_SIZE*3, PMD_SIZE - PAGE_SIZE*3,
+				MADV_DONTNEED);
+		}
+		perturber_done(state);
+	}
+	return NULL;
+}
+
+struct perturber {
+	const char *name;
+	/* returns why the perturber cannot run, or NULL */
+	const char *(*setup)(void);
+	/* runs forever with its struct perturber_state */
+	void *(*fn)(void *);
+	/* max random delay between two runs without --rate */
+	unsigned long default_us;
+};
+
+static const struct perturber perturbers[] = {
+	{ "clear_refs", clear_refs_setup, background_soft_dirty, 0 },
+	{ "pageout", pageout_setup, background_pageout, 1000 },
+	{ "swap", swap_setup, background_swap, 0 },
+	{ "migrate", migrate_setup, background_migrate, 1000 },
+	{ "ksm", ksm_setup, background_ksm, 10000 },
+	{ "compact", compact_setup, background_compact, 100000 },
+	{ "collapse", collapse_setup, background_collapse, 10000 },
+};
+
+#define NR_PERTURBERS (sizeof(perturbers) / sizeof(perturbers[0]))
+
+static struct perturber_state perturber_states[NR_PERTURBERS];
+
+static int backend_lookup(const char *name)
+{
+	for (unsigned int i = 0; i < NR_BACKENDS; i++)
+		if (!strcmp(backends[i].name, name))
+			return i;
+	return -1;
+}
+
+static int perturber_lookup(const char *name)
+{
+	for (unsigned int i = 0; i < NR_PERTURBERS; i++)
+		if (!strcmp(perturbers[i].name, name))
+			return i;
+	return -1;
+}
+
+/* parse --rate=<perturber>:N */
+static bool parse_rate(const char *arg)
+{
+	const char *colon = strchr(arg, ':');
+	if (!colon)
+		return false;
+	char *name = strndup(arg, colon - arg), *end;
+	if (!name)
+		perror("strndup"), exit(1);
+	int i = perturber_lookup(name);
+	free(name);
+	long rate = strtol(colon + 1, &end, 0);
+	if (i < 0 || end == colon + 1 || *end || rate < 0)
+		return false;
+	perturber_states[i].rate = rate;
+	return true;
+}
+
+static void report(unsigned long interval)
+{
+	unsigned long last[NR_BACKENDS] = { 0 }, start = now_ns();
+	unsigned long last_churned = 0, last_ops[NR_PERTURBERS] = { 0 };
+	for (;;) {
+		sleep(interval);
+		printf("t=%lus", (now_ns() - start) / 1000000000UL);
+		for (unsigned int i = 0; i < nr_races; i++) {
+			struct race *race = &races[i];
+			unsigned long attempts, detections;
+			attempts = __atomic_load_n(&race->attempts,
+						   __ATOMIC_RELAXED);
+			detections = __atomic_load_n(&race->detections,
+						     __ATOMIC_RELAXED);
+			printf(" %s: attempts=%lu rate=%lu/s detections=%lu",
+			       race->backend->name, attempts,
+			       (attempts - last[i]) / interval, detections);
+			last[i] = attempts;
+		}
+		if (__atomic_load_n(&swap_churning, __ATOMIC_RELAXED)) {
+			unsigned long churned;
+			churned = __atomic_load_n(&swap_churned,
+						  __ATOMIC_RELAXED);
+			printf(" swap: churn=%luMiB/s",
+			       ((churned - last_churned) * PAGE_SIZE >> 20) /
+			       interval);
+			last_churned = churned;
+		}
+		for (unsigned int i = 0; i < NR_PERTURBERS; i++) {
+			struct perturber_state *state = &perturber_states[i];
+			if (!state->running)
+				continue;
+			unsigned long ops;
+			ops = __atomic_load_n(&state->ops, __ATOMIC_RELAXED);
+			printf(" %s=%lu/s", perturbers[i].name,
+			       (ops - last_ops[i]) / interval);
+			last_ops[i] = ops;
+		}
+		printf("\n");
+		fflush(stdout);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long backend_mask = (1UL << NR_BACKENDS) - 1;
+	unsigned long perturber_mask = 1UL << 0 | 1UL << 1;
+	unsigned long interval = 1;
+	bool usage = false;
+	for (unsigned int i = 0; i < NR_PERTURBERS; i++) {
+		perturber_states[i].rate = -1;
+		perturber_states[i].default_us = perturbers[i].default_us;
+	}
+	for (int i = 1; i < argc; i++) {
+		if (!strncmp(argv[i], "--backend=", 10))
+			usage |= !parse_list(argv[i] + 10, backend_lookup,
+					     &backend_mask);
+		else if (!strncmp(argv[i], "--perturber=", 12))
+			usage |= !parse_list(argv[i] + 12, perturber_lookup,
+					     &perturber_mask);
+		else if (!strncmp(argv[i], "--rate=", 7))
+			usage |= !parse_rate(argv[i] + 7);
+		else if (!strncmp(argv[i], "--vfio=", 7))
+			vfio_device = argv[i] + 7;
+		else if (!strncmp(argv[i], "--interval=", 11)) {
+			interval = strtoul(argv[i] + 11, NULL, 0);
+			usage |= !interval;
+		} else if (!strcmp(argv[i], "--cgroup"))
+			cgroup_max = CGROUP_DEFAULT_MAX;
+		else if (!strncmp(argv[i], "--cgroup=", 9)) {
+			cgroup_max = strtoul(argv[i] + 9, NULL, 0) << 20;
+			usage |= !cgroup_max;
+		} else if (!target_file && strncmp(argv[i], "--", 2))
+			target_file = argv[i];
+		else
+			usage = true;
+	}
+	if (usage)
+		printf("%s [--backend=odirect,io_uring,vmsplice,vfio] "
+		       "[--perturber=clear_refs,pageout,swap,migrate,ksm,"
+		       "compact,collapse] [--rate=<perturber>:N] "
+		       "[--vfio=<PCI dev>] [--cgroup[=MiB]] [--interval=SEC] "
+		       "[<file>]\n",
+		       argv[0]), exit(1);
+
+	if (cgroup_max)
+		cgroup_sandbox("gup_pin_driver", cgroup_max);
+
+	for (unsigned int i = 0; i < NR_BACKENDS; i++) {
+		if (!(backend_mask & (1UL << i)))
+			continue;
+		struct race *race = &races[nr_races];
+		race->backend = &backends[i];
+		race->mem = race_alloc();
+		bzero(race->mem, PAGE_SIZE*3);
+		memset(race->mem + PAGE_SIZE*2, 0xff, HARDBLKSIZE);
+		race->skip_memset = true;
+
+		const char *err = backends[i].setup(race);
+		if (err) {
+			printf("backend %s skipped: %s\n", backends[i].name,
+			       err);
+			munmap(race->mem, PMD_SIZE);
+			continue;
+		}
+		nr_races++;
+	}
+	if (!nr_races)
+		fprintf(stderr, "no pin backend available\n"), exit(1);
+
+	delay_calibrate();
+
+	for (unsigned int i = 0; i < NR_PERTURBERS; i++) {
+		if (!(perturber_mask & (1UL << i)))
+			continue;
+		const char *err = perturbers[i].setup();
+		if (err) {
+			printf("perturber %s skipped: %s\n", perturbers[i].name,
+			       err);
+			continue;
+		}
+		pthread_t thread;
+		perturber_states[i].running = true;
+		if (pthread_create(&thread, NULL, perturbers[i].fn,
+				   &perturber_states[i]))
+			perror("pthread_create perturber"), exit(1);
+	}
+
+	for (unsigned int i = 0; i < nr_races; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, writer, &races[i]))
+			perror("pthread_create writer"), exit(1);
+		if (pthread_create(&thread, NULL, race_loop, &races[i]))
+			perror("pthread_create race"), exit(1);
+		printf("backend %s running\n", races[i].backend->name);
+	}
+	fflush(stdout);
+
+	report(interval);
+	return 0;
+}
@@ -7,12 +7,47 @@
  *  Copyright (C) 2021  Red Hat, Inc.
  *
  *  gcc -O2 -o io_uring_swap io_uring_swap.c -lpthread -luring
- *  ./io_uring_swap ./whateverfile
+ *  ./io_uring_swap [--cgroup[=MiB]] [--psi[=PCT]] \
+ *	[--depth=N [--sqpoll] [--odirect]] [--stats=<file>] [--interval=SEC] \
+ *	[--perf] ./whateverfile
  *
  *  NOTE: swap must be enabled. The smaller the total memory in the system
  *  the easier it is to reproduce. Inside a 2 GiB VM it triggers fairly
  *  reliably within minutes.
  *
+ *  --cgroup runs the reproducer inside its own cgroup v2 with a
+ *  memory.max of MiB (default 256) and only applies swap pressure
+ *  inside it, instead of swapping the whole host. It requires root
+ *  and the cgroup v2 hierarchy mounted at /sys/fs/cgroup.
+ *
+ *  --depth keeps N fixed buffers, each backed by its own page triplet,
+ *  in flight on a ring of depth N. Every completion re-pins its buffer
+ *  with an incremental buffer update instead of a full
+ *  register/unregister cycle, so the FOLL_LONGTERM pin/unpin churn is
+ *  bounded by the kernel and not by syscall round trips. --sqpoll
+ *  submits through a kernel SQ thread and --odirect reads the
+ *  registered file with O_DIRECT. It requires liburing >= 2.1 and
+ *  v5.13 or later.
+ *
+ *  --psi replaces the swap churn region with a feedback controller
+ *  that grows and shrinks a persistent hog to hold the memory pressure
+ *  stall time (PSI "some", of the cgroup with --cgroup) at PCT percent
+ *  (default 10), so the race page keeps cycling through the swap cache
+ *  without livelocking the box. It prints the measured pressure, the
+ *  hog size and the swap-in/out rates every second. It requires
+ *  CONFIG_PSI.
+ *
+ *  Progress is reported every --interval seconds (default 1) from
+ *  per-thread counters, including the MiB/s the swap churn region
+ *  pushes out; --stats=<file> places the counters in a shared file
+ *  mapping other processes can sample. --perf adds one line per thread
+ *  with the rates of its perf_event_open counters: page faults (all,
+ *  minor, major) and, where tracefs has them, the page_fault_user,
+ *  reclaim_pages, write_folio, add_to_page_cache and dirty_folio
+ *  tracepoints it hit. With perf_event_paranoid 2 the tracepoints are
+ *  left out and the fault counters miss the faults taken in the kernel
+ *  by GUP; they are printed with a :u suffix then.
+ *
  *  This is caused by the VM design flaw introduced in commit
  *  09854ba94c6aad7886996bfbee2530b3d8a7f4f4.
  *
@@ -28,10 +63,18 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <stdint.h>
+#include <time.h>
+#include <sys/prctl.h>
+#include <signal.h>
+#include <limits.h>
 #include <sys/errno.h>
 #include <sys/syscall.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <linux/perf_event.h>
 #include "liburing.h"
+#include "page_count_do_wp_page-common.h"
 
 #define PAGE_SIZE (1UL<<12)
 /*
@@ -39,54 +82,208 @@
  * corruption with an HARDBLKSIZE of 4k or more.
  */
 #define HARDBLKSIZE 512
+#define CGROUP_DEFAULT_MAX (256UL<<20)
+
+/*
+ * With --perf every thread that registers its stats also opens a
+ * group of perf_event_open counters on itself: page faults and the
+ * tracepoints of the fault, reclaim and writeback paths that tracefs
+ * knows about. The reporter reads each group with a single read() and
+ * prints the per-thread rates under the progress line. Tracepoints
+ * need root or a low perf_event_paranoid and are left out of the
+ * group when they cannot be opened or could only count userland.
+ */
+struct perf_counter {
+	const char *name;
+	uint32_t type;
+	uint64_t config;
+	/* events/ subdirectory in tracefs for PERF_TYPE_TRACEPOINT */
+	const char *tracepoint;
+};
+
+/* the same name twice is the same event under its old name */
+static const struct perf_counter perf_counters[] = {
+	{ "faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+	{ "minflt", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MIN },
+	{ "majflt", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MAJ },
+	{ "fault_user", PERF_TYPE_TRACEPOINT, 0, "exceptions/page_fault_user" },
+	{ "reclaim", PERF_TYPE_TRACEPOINT, 0,
+	  "vmscan/mm_vmscan_reclaim_pages" },
+	{ "writeout", PERF_TYPE_TRACEPOINT, 0, "vmscan/mm_vmscan_write_folio" },
+	{ "writeout", PERF_TYPE_TRACEPOINT, 0, "vmscan/mm_vmscan_writepage" },
+	{ "cache_add", PERF_TYPE_TRACEPOINT, 0,
+	  "filemap/mm_filemap_add_to_page_cache" },
+	{ "dirty", PERF_TYPE_TRACEPOINT, 0, "writeback/writeback_dirty_folio" },
+	{ "dirty", PERF_TYPE_TRACEPOINT, 0, "writeback/writeback_dirty_page" },
+};
+
+#define NR_PERF_COUNTERS (sizeof(perf_counters) / sizeof(perf_counters[0]))
+
+struct perf_group {
+	int fd;
+	/* published last, zero until the group is open */
+	unsigned int nr;
+	unsigned char counter[NR_PERF_COUNTERS];
+	/* counting userland only, printed with a :u suffix like perf */
+	bool user_only[NR_PERF_COUNTERS];
+	uint64_t last[NR_PERF_COUNTERS];
+};
+
+static struct perf_group perf_groups[STATS_MAX_THREADS];
+
+static long tracepoint_id(const char *tracepoint)
+{
+	static const char *const tracefs[] = {
+		"/sys/kernel/tracing",
+		"/sys/kernel/debug/tracing",
+	};
+	for (int i = 0; i < 2; i++) {
+		char path[PATH_MAX];
+		snprintf(path, sizeof(path), "%s/events/%s/id", tracefs[i],
+			 tracepoint);
+		FILE *file = fopen(path, "r");
+		if (!file)
+			continue;
+		long id = -1;
+		if (fscanf(file, "%ld", &id) != 1)
+			id = -1;
+		fclose(file);
+		return id;
+	}
+	return -1;
+}
+
+static int perf_open(struct perf_event_attr *attr, int group_fd)
+{
+	int fd = syscall(SYS_perf_event_open, attr, 0, -1, group_fd, 0);
+	/*
+	 * perf_event_paranoid 2 only allows counting userland. That still
+	 * means something for the fault counters, but the tracepoints
+	 * only fire in the kernel and would always read zero.
+	 */
+	if (fd < 0 && errno == EACCES && attr->type == PERF_TYPE_SOFTWARE) {
+		attr->exclude_kernel = 1;
+		fd = syscall(SYS_perf_event_open, attr, 0, -1, group_fd, 0);
+	}
+	return fd;
+}
+
+/* open the counter group of the calling thread */
+static void perf_attach(unsigned long slot, const char *name)
+{
+	struct perf_group *group = &perf_groups[slot];
+	unsigned int nr = 0;
+	group->fd = -1;
+	for (unsigned int i = 0; i < NR_PERF_COUNTERS; i++) {
+		const struct perf_counter *counter = &perf_counters[i];
+		struct perf_event_attr attr = {
+			.size = sizeof(attr),
+			.type = counter->type,
+			.config = counter->config,
+			.read_format = PERF_FORMAT_GROUP,
+			.exclude_hv = 1,
+		};
+		if (counter->tracepoint) {
+			long id = tracepoint_id(counter->tracepoint);
+			if (id < 0)
+				continue;
+			attr.config = id;
+		}
+		int fd = perf_open(&attr, group->fd);
+		if (fd < 0)
+			continue;
+		if (group->fd < 0)
+			group->fd = fd;
+		group->user_only[nr] = attr.exclude_kernel;
+		group->counter[nr++] = i;
+	}
+	if (!nr)
+		fprintf(stderr, "%s: perf counters unavailable\n", name);
+	__atomic_store_n(&group->nr, nr, __ATOMIC_RELEASE);
+}
 
-static void* writer(void *_mem)
+static void perf_report(unsigned long interval)
 {
-	volatile char *mem = (char *)_mem;
+	uint64_t values[1 + NR_PERF_COUNTERS];
+	unsigned long nr_threads = stat_read(&stats->nr_threads);
+	for (unsigned long i = 0; i < nr_threads && i < STATS_MAX_THREADS;
+	     i++) {
+		struct perf_group *group = &perf_groups[i];
+		unsigned int nr = __atomic_load_n(&group->nr, __ATOMIC_ACQUIRE);
+		if (!nr)
+			continue;
+		if (read(group->fd, values, sizeof(values)) < 0)
+			perror("read perf group"), exit(1);
+		printf("  %s:", stats->thread[i].name);
+		for (unsigned int j = 0; j < nr && j < values[0]; j++) {
+			printf(" %s%s=%lu/s",
+			       perf_counters[group->counter[j]].name,
+			       group->user_only[j] ? ":u" : "",
+			       (unsigned long) (values[1 + j] - group->last[j]) /
+			       interval);
+			group->last[j] = values[1 + j];
+		}
+		printf("\n");
+	}
+}
+
+/* the race pages, one every three pages, each followed by its checks */
+struct race_pages {
+	char *mem;
+	unsigned long nr;
+};
+
+static void* writer(void *_race)
+{
+	struct race_pages *race = _race;
+	volatile char *mem;
 	char x;
+	/* no counters of its own, but --perf reports its faults */
+	stats_register("writer");
 	for(;;) {
-		usleep(random() % 1000);
+		random_delay_us(1000);
+		mem = race->mem + (rng_next() % race->nr) * PAGE_SIZE*3;
 		x = mem[PAGE_SIZE-1];
 		mem[PAGE_SIZE-1] = x;
 	}
 	return NULL;
 }
 
-static void* background_pageout(void *_mem)
+static void* background_pageout(void *_race)
 {
-	char *mem = (char *)_mem;
+	struct race_pages *race = _race;
+	struct thread_stats *st = stats_register("pageout");
 	for(;;) {
-		usleep(random() % 1000);
-		madvise(mem, PAGE_SIZE, MADV_PAGEOUT);
+		random_delay_us(1000);
+		for (unsigned long i = 0; i < race->nr; i++) {
+			madvise(race->mem + i * PAGE_SIZE*3, PAGE_SIZE,
+				MADV_PAGEOUT);
+			stat_inc(&st->pageouts);
+		}
 	}
 	return NULL;
 }
 
 static void* background_swap(void *_size)
 {
-	unsigned long size = (unsigned long) _size;
-	for (;;) {
-		volatile char *p = malloc(size);
-		if (!p)
-			perror("malloc"), exit(1);
-		for (unsigned long i = 0; i < size; i += PAGE_SIZE) {
-			p[i] = 0;
-		}
-		free((void *)p);
-	}
+	struct thread_stats *st = stats_register("churn");
+	struct swap_churn churn;
+	churn_init(&churn, (unsigned long) _size);
+	for (;;)
+		stat_add(&st->churned, churn_step(&churn) / PAGE_SIZE);
 	return NULL;
 }
 
 static int io_uring_read_fixed(struct io_uring *ring, int fd, void *buf,
-			       size_t size)
+			       size_t size, struct thread_stats *st)
 {
-	static unsigned long count;
 	struct io_uring_cqe *cqe;
 	struct io_uring_sqe *sqe;
 	struct iovec iov;
+	unsigned long start;
 	int ret, res;
 
-	printf("Reading attempt #%lu\n", ++count);
+	stat_inc(&st->attempts);
 
 	iov.iov_base = buf;
 	iov.iov_len = size;
@@ -96,7 +293,9 @@ static int io_uring_read_fixed(struct io_uring *ring, int fd, void *buf,
 	 * If we happen to pin just after putting the page into the swap cache
 	 * and before unmapping it, we can be in trouble.
 	 */
+	start = now_ns();
 	ret = io_uring_register_buffers(ring, &iov, 1);
+	stat_latency(st->pin_hist, start);
 	if (ret) {
 		fprintf(stderr, "io_uring_register_buffers() failed: %d\n",
 			ret);
@@ -107,7 +306,7 @@ static int io_uring_read_fixed(struct io_uring *ring, int fd, void *buf,
 	 * Let's wait a bit until actually reading the content, such that any
 	 * wrong COW will see stale data.
 	 */
-	usleep(random() % 1000);
+	random_delay_us(1000);
 
 	sqe = io_uring_get_sqe(ring);
 	if (!sqe) {
@@ -135,7 +334,9 @@ static int io_uring_read_fixed(struct io_uring *ring, int fd, void *buf,
 	 * Unmap the buffer, this will unpin the target page. Unfortunately,
 	 * this might take a long time.
 	 */
+	start = now_ns();
 	ret = io_uring_unregister_buffers(ring);
+	stat_latency(st->unpin_hist, start);
 	if (ret) {
 		fprintf(stderr, "io_uring_unregister_buffers()\n");
 		return ret;
@@ -143,72 +344,280 @@ static int io_uring_read_fixed(struct io_uring *ring, int fd, void *buf,
 	return res;
 }
 
+static void check_page(char *mem, bool skip_memset, struct thread_stats *st)
+{
+	if (memcmp(mem, mem+PAGE_SIZE, HARDBLKSIZE)) {
+		stat_inc(&st->detections);
+		if (memcmp(mem, mem+PAGE_SIZE*2, PAGE_SIZE)) {
+			if (skip_memset)
+				printf("unexpected memory "
+				       "corruption detected\n");
+			else
+				printf("memory corruption detected, "
+				       "dumping page\n");
+			int end = PAGE_SIZE;
+			if (!memcmp(mem+HARDBLKSIZE, mem+PAGE_SIZE,
+				    PAGE_SIZE-HARDBLKSIZE))
+				end = HARDBLKSIZE;
+			for (int i = 0; i < end; i++)
+				printf("%x", mem[i]);
+			printf("\n");
+		} else {
+			printf("memory corruption detected\n");
+			exit(-1);
+		}
+	}
+}
+
+struct deep_slot {
+	char *mem;
+	bool skip_memset;
+};
+
+/*
+ * Pin the slot buffer by reinstalling it in the buffer table and queue a fixed read into it. Replacing an already installed buffer
+ * unpins the previous page after pinning the new one, so every
+ * completion costs a single update.
+ */
+static int deep_queue(struct io_uring *ring, struct deep_slot *slots,
+		      unsigned int idx, struct thread_stats *st)
+{
+	struct deep_slot *slot = &slots[idx];
+	struct io_uring_sqe *sqe;
+	struct iovec iov = {
+		.iov_base = slot->mem,
+		.iov_len = HARDBLKSIZE,
+	};
+	unsigned long start;
+	int ret;
+
+	/* the update pins the new page and unpins the old one */
+	start = now_ns();
+	ret = io_uring_register_buffers_update_tag(ring, idx, &iov, NULL, 1);
+	stat_latency(st->pin_hist, start);
+	if (ret != 1) {
+		fprintf(stderr, "io_uring_register_buffers_update_tag() "
+			"failed: %d\n", ret);
+		return -1;
+	}
+
+	sqe = io_uring_get_sqe(ring);
+	if (!sqe) {
+		fprintf(stderr, "io_uring_get_sqe() failed\n");
+		return -1;
+	}
+	/* fd 0 is the index in the registered file table */
+	io_uring_prep_read_fixed(sqe, 0, slot->mem, HARDBLKSIZE, 0, idx);
+	io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+	sqe->user_data = idx;
+	return 0;
+}
+
+static void io_uring_deep_loop(int fd, struct race_pages *race, bool sqpoll)
+{
+	unsigned int depth = race->nr;
+	struct io_uring_params params = { 0 };
+	struct thread_stats *st = stats_register("reader");
+	struct io_uring ring;
+	int ret;
+
+	if (sqpoll) {
+		params.flags |= IORING_SETUP_SQPOLL;
+		params.sq_thread_idle = 1000;
+	}
+	ret = io_uring_queue_init_params(depth, &ring, &params);
+	if (ret < 0) {
+		fprintf(stderr, "io_uring_queue_init_params() failed: %d\n",
+			ret);
+		exit(1);
+	}
+	ret = io_uring_register_files(&ring, &fd, 1);
+	if (ret) {
+		fprintf(stderr, "io_uring_register_files() failed: %d\n", ret);
+		exit(1);
+	}
+
+	struct deep_slot *slots = calloc(depth, sizeof(*slots));
+	struct iovec *iovs = calloc(depth, sizeof(*iovs));
+	if (!slots || !iovs)
+		perror("calloc"), exit(1);
+	for (unsigned int i = 0; i < depth; i++) {
+		slots[i].mem = race->mem + i * PAGE_SIZE*3;
+		slots[i].skip_memset = true;
+		iovs[i].iov_base = slots[i].mem;
+		iovs[i].iov_len = HARDBLKSIZE;
+	}
+	/*
+	 * IORING_RSRC_REGISTER_SPARSE only exists from v5.19: fill the
+	 * table with the slot buffers themselves, every update then
+	 * replaces one of them.
+	 */
+	ret = io_uring_register_buffers_tags(&ring, iovs, NULL, depth);
+	if (ret) {
+		fprintf(stderr, "io_uring_register_buffers_tags() "
+			"failed: %d\n", ret);
+		exit(1);
+	}
+	free(iovs);
+	for (unsigned int i = 0; i < depth; i++)
+		if (deep_queue(&ring, slots, i, st))
+			exit(1);
+
+	struct io_uring_cqe **cqes = calloc(depth, sizeof(*cqes));
+	if (!cqes)
+		perror("calloc"), exit(1);
+	for (;;) {
+		ret = io_uring_submit_and_wait(&ring, 1);
+		if (ret < 0) {
+			fprintf(stderr, "io_uring_submit_and_wait() "
+				"failed: %d\n", ret);
+			exit(1);
+		}
+
+		unsigned int nr = io_uring_peek_batch_cqe(&ring, cqes, depth);
+		for (unsigned int i = 0; i < nr; i++) {
+			unsigned int idx = cqes[i]->user_data;
+			struct deep_slot *slot = &slots[idx];
+
+			if (cqes[i]->res != HARDBLKSIZE) {
+				fprintf(stderr, "read_fixed failed: %d\n",
+					cqes[i]->res);
+				exit(-1);
+			}
+			stat_inc(&st->attempts);
+			check_page(slot->mem, slot->skip_memset, st);
+			slot->skip_memset = !slot->skip_memset;
+			if (!slot->skip_memset)
+				memset(slot->mem, 0xff, HARDBLKSIZE);
+			if (deep_queue(&ring, slots, idx, st))
+				exit(1);
+		}
+		io_uring_cq_advance(&ring, nr);
+	}
+}
+
 int main(int argc, char *argv[])
 {
-	if (argc < 2)
-		printf("%s <filename>\n", argv[0]), exit(1);
+	char *filename = NULL, *stats_path = NULL;
+	double psi_target = 0;
+	unsigned long cgroup_max = 0, depth = 0, interval = 1;
+	bool sqpoll = false, odirect = false;
+	for (int i = 1; i < argc; i++) {
+		if (!strncmp(argv[i], "--stats=", 8))
+			stats_path = argv[i] + 8;
+		else if (!strncmp(argv[i], "--interval=", 11)) {
+			interval = strtoul(argv[i] + 11, NULL, 0);
+			if (!interval)
+				printf("invalid interval\n"), exit(1);
+		} else if (!strncmp(argv[i], "--depth=", 8)) {
+			depth = strtoul(argv[i] + 8, NULL, 0);
+			if (!depth)
+				printf("invalid depth\n"), exit(1);
+		} else if (!strcmp(argv[i], "--sqpoll"))
+			sqpoll = true;
+		else if (!strcmp(argv[i], "--odirect"))
+			odirect = true;
+		else if (!strcmp(argv[i], "--perf")) {
+			stats_attach_hook = perf_attach;
+			stats_report_hook = perf_report;
+		}
+		else if (!strcmp(argv[i], "--psi"))
+			psi_target = 10;
+		else if (!strncmp(argv[i], "--psi=", 6)) {
+			psi_target = strtod(argv[i] + 6, NULL);
+			if (psi_target <= 0 || psi_target >= 100)
+				printf("invalid psi target\n"), exit(1);
+		} else if (!strcmp(argv[i], "--cgroup"))
+			cgroup_max = CGROUP_DEFAULT_MAX;
+		else if (!strncmp(argv[i], "--cgroup=", 9)) {
+			cgroup_max = strtoul(argv[i] + 9, NULL, 0) << 20;
+			if (!cgroup_max)
+				printf("invalid cgroup size\n"), exit(1);
+		} else if (!filename)
+			filename = argv[i];
+		else {
+			filename = NULL;
+			break;
+		}
+	}
+	if (!filename || ((sqpoll || odirect) && !depth))
+		printf("%s [--cgroup[=MiB]] [--psi[=PCT]] "
+		       "[--depth=N [--sqpoll] [--odirect]] "
+		       "[--stats=<file>] [--interval=SEC] [--perf] <filename>\n",
+		       argv[0]), exit(1);
+
+	if (cgroup_max)
+		cgroup_sandbox("io_uring_swap", cgroup_max);
 
+	struct race_pages race = { .nr = depth ? depth : 1 };
 	char *mem;
-	if (posix_memalign((void **)&mem, PAGE_SIZE, PAGE_SIZE*3))
+	if (posix_memalign((void **)&mem, PAGE_SIZE, PAGE_SIZE*3*race.nr))
 		perror("posix_memalign"), exit(1);
+	race.mem = mem;
 
 	/* THP is not using page_count so it would not corrupt memory */
-	if (madvise(mem, PAGE_SIZE, MADV_NOHUGEPAGE))
+	if (madvise(mem, PAGE_SIZE*3*race.nr, MADV_NOHUGEPAGE))
 		perror("madvise"), exit(1);
 
-	bzero(mem, PAGE_SIZE * 3);
-	memset(mem + PAGE_SIZE * 2, 0xff, HARDBLKSIZE);
+	bzero(mem, PAGE_SIZE*3*race.nr);
+	for (unsigned long i = 0; i < race.nr; i++)
+		memset(mem + i * PAGE_SIZE*3 + PAGE_SIZE * 2, 0xff,
+		       HARDBLKSIZE);
 
-	int fd = open(argv[1], O_CREAT|O_RDWR|O_TRUNC, 0600);
+	int fd = open(filename, O_CREAT|O_RDWR|O_TRUNC|(odirect ? O_DIRECT : 0),
+		      0600);
 	if (fd < 0)
 		perror("open"), exit(1);
 	if (write(fd, mem, PAGE_SIZE) != PAGE_SIZE)
 		perror("write"), exit(1);
 
-	FILE *file = fopen("/proc/meminfo", "r");
-	if (!file)
-		perror("fopen meminfo"), exit(1);
-
-	char *line = NULL;
-	size_t len = 0;
-	unsigned long mem_total = 0, mem_avail = 0, swap_total = 0, swap_free = 0;
-	int match = 0;
-	while (getline(&line, &len, file) > 0) {
-		if (sscanf(line, "MemTotal: %lu kB", &mem_total))
-			match++;
-		if (sscanf(line, "MemAvailable: %lu kB", &mem_avail))
-			match++;
-		if (sscanf(line, "SwapTotal: %lu kB", &swap_total))
-			match++;
-		if (sscanf(line, "SwapFree: %lu kB", &swap_free)) {
-			match++;
-			break;
-		}
-	}
+	struct meminfo mi;
+	if (!meminfo_read(&mi))
+		fprintf(stderr, "/proc/meminfo error\n"), exit(1);
 
 	/* Consume an additional 1 GiB */
-	unsigned long size_kb = mem_total + 1024*1024;
+	unsigned long size_kb = mi.mem_total + 1024*1024;
+	/* or twice memory.max to keep reclaim busy inside the cgroup */
+	if (cgroup_max) {
+		size_kb = cgroup_max * 2 / 1024;
+		mi.mem_avail = cgroup_max / 1024;
+	}
 
-	if (match != 4 || swap_free > swap_total)
-		fprintf(stderr, "/proc/meminfo error\n"), exit(1);
-	if (!swap_total || !swap_free || swap_free < size_kb - mem_avail)
+	if (!mi.swap_total || !mi.swap_free ||
+	    mi.swap_free < size_kb - mi.mem_avail)
 		fprintf(stderr, "not enough swap\n"), exit(1);
 
 	unsigned long size = size_kb * 1024;
 	printf("Will allocate %lu MiB in order to swap\n", size / 1024 / 1024);
 
+	stats_init(stats_path);
+	delay_calibrate();
+
+	pthread_t reporter;
+	if (pthread_create(&reporter, NULL, stats_reporter, (void *)interval))
+		perror("pthread_create reporter"), exit(1);
+
 	pthread_t pageout;
-	if (pthread_create(&pageout, NULL, background_pageout, mem))
+	if (pthread_create(&pageout, NULL, background_pageout, &race))
 		perror("pthread_create pageout"), exit(1);
 
 	pthread_t swap;
-	if (pthread_create(&swap, NULL, background_swap, (void *)size))
+	if (psi_target) {
+		static struct psi_controller psi;
+		psi_init(&psi, psi_target, size,
+			 cgroup_max ? sandbox_dir : NULL);
+		if (pthread_create(&swap, NULL, background_psi, &psi))
+			perror("pthread_create psi"), exit(1);
+	} else if (pthread_create(&swap, NULL, background_swap, (void *)size))
 		perror("pthread_create swap"), exit(1);
 
 	pthread_t thread;
-	if (pthread_create(&thread, NULL, writer, mem))
+	if (pthread_create(&thread, NULL, writer, &race))
 		perror("pthread_create writer"), exit(1);
 
+	if (depth)
+		io_uring_deep_loop(fd, &race, sqpoll);
+
 	struct io_uring ring;
 	int ret = io_uring_queue_init(1, &ring, 0);
 	if (ret < 0) {
@@ -216,32 +625,15 @@ int main(int argc, char *argv[])
 		exit(ret);
 	}
 
+	struct thread_stats *st = stats_register("reader");
 	bool skip_memset = true;
 	while (1) {
-		if (io_uring_read_fixed(&ring, fd, mem, HARDBLKSIZE) != HARDBLKSIZE) {
+		if (io_uring_read_fixed(&ring, fd, mem, HARDBLKSIZE,
+					st) != HARDBLKSIZE) {
 			fprintf(stderr, "io_uring_read_fixed() failed\n");
 			exit(-1);
 		}
-		if (memcmp(mem, mem+PAGE_SIZE, HARDBLKSIZE)) {
-			if (memcmp(mem, mem+PAGE_SIZE*2, PAGE_SIZE)) {
-				if (skip_memset)
-					printf("unexpected memory "
-					       "corruption detected\n");
-				else
-					printf("memory corruption detected, "
-					       "dumping page\n");
-				int end = PAGE_SIZE;
-				if (!memcmp(mem+HARDBLKSIZE, mem+PAGE_SIZE,
-					    PAGE_SIZE-HARDBLKSIZE))
-					end = HARDBLKSIZE;
-				for (int i = 0; i < end; i++)
-					printf("%x", mem[i]);
-				printf("\n");
-			} else {
-				printf("memory corruption detected\n");
-				exit(-1);
-			}
-		}
+		check_page(mem, skip_memset, st);
 		skip_memset = !skip_memset;
 		if (!skip_memset)
 			memset(mem, 0xff, HARDBLKSIZE);
@@ -0,0 +1,885 @@
+/* SPDX-License-Identifier: GPL-3.0-or-later */
+/*
+ *  Copyright (C) 2021  Red Hat, Inc.
+ *
+ * Helpers shared by the page_count_do_wp_page reproducers, the swap
+ * variants, gup_pin_driver and cow_gup_bench. Every program is a
+ * single translation unit, so everything here is static and included
+ * only once.
+ */
+
+#ifndef PAGE_COUNT_DO_WP_PAGE_COMMON_H
+#define PAGE_COUNT_DO_WP_PAGE_COMMON_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <linux/loop.h>
+#include <linux/vfio.h>
+
+#ifndef PAGE_SIZE
+#define PAGE_SIZE (1UL<<12)
+#endif
+
+static inline unsigned long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/*
+ * Per-thread xorshift64* PRNG and nanosecond resolution delays, so the
+ * racing threads neither serialize on the glibc random() lock nor get
+ * their jitter rounded up by the timer slack of usleep().
+ */
+static __thread uint64_t rng_state;
+static unsigned long sleep_overshoot_ns;
+
+static inline uint64_t rng_next(void)
+{
+	if (!rng_state) {
+		rng_state = (now_ns() ^ syscall(SYS_gettid) *
+			     0x9e3779b97f4a7c15ULL) | 1;
+		/* per-thread attribute, only the spinning tail is precise */
+		prctl(PR_SET_TIMERSLACK, 1UL);
+	}
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#else
+	asm volatile("" ::: "memory");
+#endif
+}
+
+static inline void delay_ns(unsigned long ns)
+{
+	unsigned long end = now_ns() + ns;
+	if (ns > sleep_overshoot_ns) {
+		unsigned long sleep = ns - sleep_overshoot_ns;
+		struct timespec ts = {
+			.tv_sec = sleep / 1000000000UL,
+			.tv_nsec = sleep % 1000000000UL,
+		};
+		clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, NULL);
+	}
+	while (now_ns() < end)
+		cpu_relax();
+}
+
+static inline void random_delay_us(unsigned long max_us)
+{
+	delay_ns(rng_next() % (max_us * 1000));
+}
+
+/* measure how late a short sleep wakes up, the rest is spun */
+static inline void delay_calibrate(void)
+{
+	unsigned long overshoot[101];
+	prctl(PR_SET_TIMERSLACK, 1UL);
+	for (int i = 0; i < 101; i++) {
+		struct timespec ts = { .tv_nsec = 1000 };
+		unsigned long start = now_ns();
+		clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, NULL);
+		unsigned long ns = now_ns() - start;
+		overshoot[i] = ns > 1000 ? ns - 1000 : 0;
+		/* insertion sort, it runs once */
+		for (int j = i; j && overshoot[j] < overshoot[j-1]; j--) {
+			unsigned long tmp = overshoot[j];
+			overshoot[j] = overshoot[j-1];
+			overshoot[j-1] = tmp;
+		}
+	}
+	sleep_overshoot_ns = overshoot[50];
+}
+
+/*
+ * Swap churn engine. Instead of a malloc() and free() of the whole
+ * size every cycle, paying zero-fill faults and page table teardown
+ * for all of it, one region is mapped once and rotated in CHURN_CHUNK
+ * sub-ranges: every chunk is re-touched, deactivated with MADV_COLD
+ * and pushed to swap with MADV_PAGEOUT, with the phases staggered so
+ * the region always holds chunks in each of them and most of the
+ * re-touches fault in from swap. Every CHURN_DROP_ROUNDS rounds the
+ * pageout of a chunk becomes a MADV_DONTNEED, handing its swap slots
+ * back.
+ */
+#define CHURN_CHUNK (2UL<<20)
+#define CHURN_DROP_ROUNDS 16
+
+enum churn_phase {
+	CHURN_TOUCH,
+	CHURN_COLD,
+	CHURN_PAGEOUT,
+	NR_CHURN_PHASES,
+};
+
+struct swap_churn {
+	char *region;
+	unsigned long nr_chunks;
+	unsigned long chunk;
+	unsigned long round;
+};
+
+static inline void churn_init(struct swap_churn *churn, unsigned long size)
+{
+	churn->nr_chunks = (size + CHURN_CHUNK - 1) / CHURN_CHUNK;
+	churn->region = mmap(NULL, churn->nr_chunks * CHURN_CHUNK,
+			     PROT_READ|PROT_WRITE,
+			     MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (churn->region == MAP_FAILED)
+		perror("mmap churn"), exit(1);
+	churn->chunk = churn->round = 0;
+}
+
+/* move the next chunk through its phase, returns the bytes pushed out */
+static inline unsigned long churn_step(struct swap_churn *churn)
+{
+	volatile char *p = churn->region + churn->chunk * CHURN_CHUNK;
+	unsigned long pushed = 0;
+	switch ((churn->chunk + churn->round) % NR_CHURN_PHASES) {
+	case CHURN_TOUCH:
+		for (unsigned long i = 0; i < CHURN_CHUNK; i += PAGE_SIZE)
+			p[i] = 0;
+		break;
+	case CHURN_COLD:
+		madvise((char *)p, CHURN_CHUNK, MADV_COLD);
+		break;
+	case CHURN_PAGEOUT:
+		madvise((char *)p, CHURN_CHUNK,
+			churn->round % CHURN_DROP_ROUNDS ?
+			MADV_PAGEOUT : MADV_DONTNEED);
+		pushed = CHURN_CHUNK;
+		break;
+	}
+	if (++churn->chunk == churn->nr_chunks) {
+		churn->chunk = 0;
+		churn->round++;
+	}
+	return pushed;
+}
+
+/*
+ * Feedback controller for --psi. Instead of a hog of fixed size, a
+ * persistent hog region is kept cycling under the memory pressure
+ * target: every period the share of time some task stalled on memory
+ * (the PSI "some" total, of the sandbox cgroup if any) is measured,
+ * and the touched part of the hog grows while the stall is below the
+ * target and is shrunk with MADV_DONTNEED while it is above, by a
+ * step proportional to the error.
+ */
+#define PSI_PERIOD_NS 1000000000UL
+
+struct psi_controller {
+	char pressure[PATH_MAX];
+	double target;
+	char *hog;
+	unsigned long max;
+	unsigned long size;
+};
+
+/* cgroup is the sandbox cgroup directory, or NULL for the whole host */
+static inline void psi_init(struct psi_controller *psi, double target,
+			    unsigned long max, const char *cgroup)
+{
+	psi->target = target;
+	psi->max = max;
+	psi->size = 0;
+	if (snprintf(psi->pressure, sizeof(psi->pressure), "%s/%s",
+		     cgroup ? cgroup : "/proc/pressure",
+		     cgroup ? "memory.pressure" : "memory") >=
+	    (int) sizeof(psi->pressure))
+		fprintf(stderr, "psi path too long\n"), exit(1);
+	/* the controller decides how much of it gets touched */
+	psi->hog = mmap(NULL, psi->max, PROT_READ|PROT_WRITE,
+			MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (psi->hog == MAP_FAILED)
+		perror("mmap hog"), exit(1);
+}
+
+static inline bool psi_some_total(const char *path, unsigned long *total)
+{
+	FILE *file = fopen(path, "r");
+	if (!file)
+		return false;
+	bool found = fscanf(file, "some avg10=%*f avg60=%*f avg300=%*f "
+			    "total=%lu", total) == 1;
+	fclose(file);
+	return found;
+}
+
+static inline void vmstat_swap(unsigned long *pswpin,
+			       unsigned long *pswpout)
+{
+	FILE *file = fopen("/proc/vmstat", "r");
+	if (!file)
+		perror("fopen vmstat"), exit(1);
+	char *line = NULL;
+	size_t len = 0;
+	while (getline(&line, &len, file) > 0) {
+		sscanf(line, "pswpin %lu", pswpin);
+		sscanf(line, "pswpout %lu", pswpout);
+	}
+	free(line);
+	fclose(file);
+}
+
+static inline void* background_psi(void *_psi)
+{
+	struct psi_controller *psi = _psi;
+	unsigned long stall, pswpin = 0, pswpout = 0, cursor = 0;
+	unsigned long start = now_ns();
+	if (!psi_some_total(psi->pressure, &stall))
+		perror(psi->pressure), exit(1);
+	vmstat_swap(&pswpin, &pswpout);
+
+	for (;;) {
+		/* keep the hog hot so reclaim has to keep swapping */
+		unsigned long end = start + PSI_PERIOD_NS;
+		while (psi->size && now_ns() < end)
+			for (int i = 0; i < 256; i++) {
+				psi->hog[cursor] = 1;
+				cursor += PAGE_SIZE;
+				if (cursor >= psi->size)
+					cursor = 0;
+			}
+		if (!psi->size)
+			delay_ns(end - now_ns());
+
+		unsigned long now = now_ns(), prev_stall = stall;
+		unsigned long prev_in = pswpin, prev_out = pswpout;
+		if (!psi_some_total(psi->pressure, &stall))
+			perror(psi->pressure), exit(1);
+		vmstat_swap(&pswpin, &pswpout);
+		double elapsed = (now - start) / 1e9;
+		double some = (stall - prev_stall) / 1e4 / elapsed;
+		start = now;
+
+		double error = (psi->target - some) / psi->target;
+		if (error > 1)
+			error = 1;
+		else if (error < -1)
+			error = -1;
+		long step = error * (psi->max / 32);
+		unsigned long size = psi->size;
+		if (step < 0 && (unsigned long) -step > size)
+			size = 0;
+		else
+			size += step;
+		if (size > psi->max)
+			size = psi->max;
+		size &= ~(PAGE_SIZE - 1);
+		if (size < psi->size &&
+		    madvise(psi->hog + size, psi->size - size, MADV_DONTNEED))
+			perror("madvise DONTNEED"), exit(1);
+		psi->size = size;
+
+		printf("psi some=%.1f%% target=%.1f%% hog=%luMiB "
+		       "pswpin=%.0f/s pswpout=%.0f/s\n", some, psi->target,
+		       size >> 20, (pswpin - prev_in) / elapsed,
+		       (pswpout - prev_out) / elapsed);
+		fflush(stdout);
+	}
+	return NULL;
+}
+
+/* the /proc/meminfo fields the swap variants size themselves from, in kB */
+struct meminfo {
+	unsigned long mem_total;
+	unsigned long mem_free;
+	unsigned long mem_avail;
+	unsigned long swap_total;
+	unsigned long swap_free;
+};
+
+/* returns false if a field is missing or the swap fields make no sense */
+static inline bool meminfo_read(struct meminfo *mi)
+{
+	FILE *file = fopen("/proc/meminfo", "r");
+	if (!file)
+		return false;
+
+	char *line = NULL;
+	size_t len = 0;
+	int match = 0;
+	while (getline(&line, &len, file) > 0) {
+		match += sscanf(line, "MemTotal: %lu kB", &mi->mem_total) == 1;
+		match += sscanf(line, "MemFree: %lu kB", &mi->mem_free) == 1;
+		match += sscanf(line, "MemAvailable: %lu kB",
+				&mi->mem_avail) == 1;
+		match += sscanf(line, "SwapTotal: %lu kB",
+				&mi->swap_total) == 1;
+		match += sscanf(line, "SwapFree: %lu kB", &mi->swap_free) == 1;
+	}
+	free(line);
+	fclose(file);
+	return match == 5 && mi->swap_free <= mi->swap_total;
+}
+
+#define CGROUP_ROOT "/sys/fs/cgroup"
+
+static inline int cgroup_write(const char *dir, const char *file,
+			       const char *val)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", dir, file);
+	int fd = open(path, O_WRONLY);
+	if (fd < 0)
+		return -1;
+	ssize_t ret = write(fd, val, strlen(val));
+	close(fd);
+	return ret == (ssize_t) strlen(val) ? 0 : -1;
+}
+
+static pid_t sandbox_pid;
+static char sandbox_dir[PATH_MAX];
+
+static inline void sandbox_forward_signal(int sig)
+{
+	kill(sandbox_pid, sig);
+}
+
+/*
+ * Run the reproducer in a child confined in its own cgroup v2 with a
+ * small memory.max, so reclaim happens only inside the cgroup instead
+ * of swapping the whole host. The parent stays outside the cgroup and
+ * removes it after the child exits. sandbox_dir is the cgroup of the
+ * child.
+ */
+static inline void cgroup_sandbox(const char *name, unsigned long limit)
+{
+	char *dir = sandbox_dir, buf[32];
+
+	if (cgroup_write(CGROUP_ROOT, "cgroup.subtree_control", "+memory"))
+		perror("enable memory controller in " CGROUP_ROOT), exit(1);
+	snprintf(dir, sizeof(sandbox_dir), CGROUP_ROOT "/%s-%d", name,
+		 getpid());
+	if (mkdir(dir, 0755))
+		perror("mkdir cgroup"), exit(1);
+	snprintf(buf, sizeof(buf), "%lu", limit);
+	if (cgroup_write(dir, "memory.max", buf))
+		perror("write memory.max"), rmdir(dir), exit(1);
+	printf("Sandboxed in %s with memory.max %lu MiB\n",
+	       dir, limit / 1024 / 1024);
+	fflush(stdout);
+
+	sandbox_pid = fork();
+	if (sandbox_pid < 0)
+		perror("fork"), rmdir(dir), exit(1);
+	if (!sandbox_pid) {
+		if (cgroup_write(dir, "cgroup.procs", "0"))
+			perror("write cgroup.procs"), exit(1);
+		return;
+	}
+
+	signal(SIGINT, sandbox_forward_signal);
+	signal(SIGTERM, sandbox_forward_signal);
+	int status;
+	while (waitpid(sandbox_pid, &status, 0) < 0)
+		if (errno != EINTR)
+			perror("waitpid"), exit(1);
+	/* the cgroup may stay busy for a moment after the last exit */
+	for (int i = 0; rmdir(dir) && errno == EBUSY && i < 100; i++)
+		usleep(10000);
+	exit(WIFEXITED(status) ? WEXITSTATUS(status) : 1);
+}
+
+/*
+ * RAM-backed O_DIRECT target for --ramdisk, so the read pin lasts
+ * microseconds instead of the latency of the disk holding the file: a
+ * loop device over an unlinked tmpfs file, which is detached and freed
+ * when its last file descriptor is closed, so nothing is left behind
+ * at exit. It needs root, otherwise the fallback file is used. size
+ * must cover every block the program reads or writes.
+ */
+static int ramdisk_loop_fd = -1;
+
+static inline const char *ramdisk_loop(unsigned long size)
+{
+	static char path[32];
+	char backing[] = "/dev/shm/page_count_do_wp_page-XXXXXX";
+	int file = mkstemp(backing);
+	if (file < 0)
+		return NULL;
+	unlink(backing);
+	const char *ret = NULL;
+	size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	if (ftruncate(file, size))
+		goto out;
+	int ctl = open("/dev/loop-control", O_RDWR);
+	if (ctl < 0)
+		goto out;
+	int nr = ioctl(ctl, LOOP_CTL_GET_FREE);
+	close(ctl);
+	if (nr < 0)
+		goto out;
+	snprintf(path, sizeof(path), "/dev/loop%d", nr);
+	int loop = open(path, O_RDWR);
+	if (loop < 0)
+		goto out;
+	if (ioctl(loop, LOOP_SET_FD, file)) {
+		close(loop);
+		goto out;
+	}
+	struct loop_info64 info = { .lo_flags = LO_FLAGS_AUTOCLEAR };
+	if (ioctl(loop, LOOP_SET_STATUS64, &info))
+		perror("LOOP_SET_STATUS64");
+	/* 512 byte blocks, so HARDBLKSIZE reads are aligned */
+	ioctl(loop, LOOP_SET_BLOCK_SIZE, 512);
+	/* tmpfs takes direct I/O since v6.6, before it is page cache */
+	ioctl(loop, LOOP_SET_DIRECT_IO, 1);
+	/* keep it attached until exit */
+	ramdisk_loop_fd = loop;
+	ret = path;
+out:
+	close(file);
+	return ret;
+}
+
+static inline const char *ramdisk(const char *fallback, unsigned long size)
+{
+	const char *path = ramdisk_loop(size);
+	if (path)
+		printf("RAM-backed O_DIRECT target %s\n", path);
+	else {
+		printf("no RAM-backed target available, using %s\n",
+		       fallback);
+		path = fallback;
+	}
+	fflush(stdout);
+	return path;
+}
+
+/*
+ * Thread placement driven by the CPU topology in sysfs. The reader is
+ * placed first and the writer and the perturber relative to it, so
+ * the race threads can be kept on SMT siblings, on one LLC or on
+ * different LLCs or NUMA nodes. Unused CPUs are preferred so the
+ * groups placed by one program don't stack on each other.
+ */
+struct cpu_topo {
+	int cpu;
+	int core;
+	int llc;
+	int node;
+	bool used;
+};
+
+static struct cpu_topo *topo;
+static int nr_topo;
+
+static inline int read_first_cpu(const char *fmt, int cpu)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), fmt, cpu);
+	FILE *file = fopen(path, "r");
+	if (!file)
+		return -1;
+	int first = -1;
+	if (fscanf(file, "%d", &first) != 1)
+		first = -1;
+	fclose(file);
+	return first;
+}
+
+static inline int cpu_llc(int cpu)
+{
+	for (int index = 0;; index++) {
+		char path[PATH_MAX];
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/cpu/cpu%d/cache/index%d/level",
+			 cpu, index);
+		FILE *file = fopen(path, "r");
+		if (!file)
+			break;
+		int level = 0;
+		if (fscanf(file, "%d", &level) != 1)
+			level = 0;
+		fclose(file);
+		if (level != 3)
+			continue;
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/cpu/cpu%%d/cache/index%d/"
+			 "shared_cpu_list", index);
+		return read_first_cpu(path, cpu);
+	}
+	/* no L3, treat the package as the LLC */
+	return read_first_cpu("/sys/devices/system/cpu/cpu%d/"
+			      "topology/physical_package_id", cpu);
+}
+
+static inline int cpu_node(int cpu)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+	DIR *dir = opendir(path);
+	if (!dir)
+		return 0;
+	int node = 0;
+	struct dirent *dirent;
+	while ((dirent = readdir(dir)))
+		if (sscanf(dirent->d_name, "node%d", &node) == 1)
+			break;
+	closedir(dir);
+	return node;
+}
+
+static inline void topo_init(void)
+{
+	cpu_set_t online;
+	if (sched_getaffinity(0, sizeof(online), &online))
+		perror("sched_getaffinity"), exit(1);
+	topo = calloc(CPU_COUNT(&online), sizeof(*topo));
+	if (!topo)
+		perror("calloc"), exit(1);
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, &online))
+			continue;
+		struct cpu_topo *t = &topo[nr_topo++];
+		t->cpu = cpu;
+		t->core = read_first_cpu("/sys/devices/system/cpu/cpu%d/"
+					 "topology/thread_siblings_list", cpu);
+		if (t->core < 0)
+			t->core = cpu;
+		t->llc = cpu_llc(cpu);
+		t->node = cpu_node(cpu);
+	}
+}
+
+enum cpu_relation {
+	REL_ANY,
+	REL_SMT_SIBLING,
+	REL_SAME_LLC,
+	REL_OTHER_LLC,
+	REL_OTHER_NODE,
+};
+
+static inline bool cpu_related(struct cpu_topo *t, struct cpu_topo *ref,
+			       enum cpu_relation rel)
+{
+	if (!ref)
+		return true;
+	if (t == ref)
+		return false;
+	switch (rel) {
+	case REL_SMT_SIBLING:
+		return t->core == ref->core;
+	case REL_SAME_LLC:
+		return t->llc == ref->llc && t->core != ref->core;
+	case REL_OTHER_LLC:
+		return t->llc != ref->llc;
+	case REL_OTHER_NODE:
+		return t->node != ref->node;
+	default:
+		return true;
+	}
+}
+
+static inline struct cpu_topo *topo_pick(struct cpu_topo *ref,
+					 enum cpu_relation rel)
+{
+	struct cpu_topo *found = NULL;
+	for (int i = 0; i < nr_topo; i++) {
+		struct cpu_topo *t = &topo[i];
+		if (!cpu_related(t, ref, rel))
+			continue;
+		if (!t->used) {
+			found = t;
+			break;
+		}
+		if (!found)
+			found = t;
+	}
+	if (found)
+		found->used = true;
+	return found;
+}
+
+struct placement_policy {
+	const char *name;
+	enum cpu_relation writer;
+	enum cpu_relation perturber;
+};
+
+static const struct placement_policy placement_policies[] = {
+	{ "smt", REL_SMT_SIBLING, REL_SAME_LLC },
+	{ "llc", REL_SAME_LLC, REL_SAME_LLC },
+	{ "cross-llc", REL_OTHER_LLC, REL_SAME_LLC },
+	{ "cross-node", REL_OTHER_NODE, REL_SAME_LLC },
+};
+
+static const struct placement_policy *placement;
+
+static inline const struct placement_policy *
+placement_lookup(const char *name)
+{
+	for (unsigned int i = 0; i < sizeof(placement_policies) /
+		     sizeof(placement_policies[0]); i++)
+		if (!strcmp(placement_policies[i].name, name))
+			return &placement_policies[i];
+	return NULL;
+}
+
+static inline void set_affinity(pthread_t thread, int cpu)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (pthread_setaffinity_np(thread, sizeof(set), &set))
+		perror("pthread_setaffinity_np"), exit(1);
+}
+
+/* pick the CPUs of one reader/writer/perturber group and record them */
+static inline void place(const char *group, pthread_t reader,
+			 pthread_t writer, pthread_t perturber)
+{
+	struct cpu_topo *r = topo_pick(NULL, REL_ANY);
+	struct cpu_topo *w = topo_pick(r, placement->writer);
+	struct cpu_topo *p = topo_pick(r, placement->perturber);
+	if (!w || !p) {
+		fprintf(stderr, "placement %s impossible on this topology\n",
+			placement->name);
+		exit(1);
+	}
+	set_affinity(reader, r->cpu);
+	set_affinity(writer, w->cpu);
+	set_affinity(perturber, p->cpu);
+	printf("placement policy=%s %s reader=%d writer=%d perturber=%d "
+	       "(llc %d/%d/%d node %d/%d/%d)\n", placement->name, group,
+	       r->cpu, w->cpu, p->cpu, r->llc, w->llc, p->llc,
+	       r->node, w->node, p->node);
+}
+
+/*
+ * Per-thread counters updated by the hot loops without locks or
+ * syscalls. Every thread only ever writes its own slot and the
+ * reporter samples all slots at a fixed interval, so reporting never
+ * slows down the race. With --stats=<file> the counters live in a
+ * shared mapping of that file and can be sampled by other processes.
+ * The programs only pick the counters their threads bump; the hooks
+ * let them attach more per-thread state and report lines of their own.
+ */
+#define STATS_MAX_THREADS 16
+#define STATS_HIST_BUCKETS 40
+
+struct thread_stats {
+	char name[16];
+	unsigned long attempts;
+	unsigned long detections;
+	unsigned long pageouts;
+	unsigned long churned;
+	/* log2(ns) latency buckets */
+	unsigned long pin_hist[STATS_HIST_BUCKETS];
+	unsigned long unpin_hist[STATS_HIST_BUCKETS];
+} __attribute__((aligned(64)));
+
+struct stats_page {
+	unsigned long nr_threads;
+	struct thread_stats thread[STATS_MAX_THREADS];
+};
+
+static struct stats_page *stats;
+/* optional, set before the first stats_register() */
+static void (*stats_attach_hook)(unsigned long slot, const char *name);
+static void (*stats_report_hook)(unsigned long interval);
+
+static inline void stats_init(const char *path)
+{
+	int fd = -1, flags = MAP_SHARED|MAP_ANONYMOUS;
+	if (path) {
+		fd = open(path, O_CREAT|O_RDWR|O_TRUNC, 0644);
+		if (fd < 0)
+			perror("open stats"), exit(1);
+		if (ftruncate(fd, sizeof(*stats)))
+			perror("ftruncate stats"), exit(1);
+		flags = MAP_SHARED;
+	}
+	stats = mmap(NULL, sizeof(*stats), PROT_READ|PROT_WRITE, flags, fd, 0);
+	if (stats == MAP_FAILED)
+		perror("mmap stats"), exit(1);
+	if (fd >= 0)
+		close(fd);
+}
+
+static inline struct thread_stats *stats_register(const char *name)
+{
+	unsigned long nr = __atomic_fetch_add(&stats->nr_threads, 1,
+					      __ATOMIC_RELAXED);
+	if (nr >= STATS_MAX_THREADS)
+		fprintf(stderr, "too many stats threads\n"), exit(1);
+	strncpy(stats->thread[nr].name, name,
+		sizeof(stats->thread[nr].name) - 1);
+	if (stats_attach_hook)
+		stats_attach_hook(nr, name);
+	return &stats->thread[nr];
+}
+
+static inline void stat_inc(unsigned long *counter)
+{
+	__atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+static inline void stat_add(unsigned long *counter, unsigned long n)
+{
+	__atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+static inline unsigned long stat_read(unsigned long *counter)
+{
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static inline void stat_latency(unsigned long *hist, unsigned long start)
+{
+	unsigned long ns = now_ns() - start;
+	unsigned int bucket = ns ? 64 - __builtin_clzl(ns) : 0;
+	if (bucket >= STATS_HIST_BUCKETS)
+		bucket = STATS_HIST_BUCKETS - 1;
+	stat_inc(&hist[bucket]);
+}
+
+/* upper bound in ns of the bucket holding the given percentile */
+static inline unsigned long hist_percentile(unsigned long *hist,
+					    unsigned int pct)
+{
+	unsigned long total = 0, sum = 0;
+	for (int i = 0; i < STATS_HIST_BUCKETS; i++)
+		total += hist[i];
+	if (!total)
+		return 0;
+	for (int i = 0; i < STATS_HIST_BUCKETS; i++) {
+		sum += hist[i];
+		if (sum * 100 >= total * pct)
+			return 1UL << i;
+	}
+	return 1UL << (STATS_HIST_BUCKETS - 1);
+}
+
+static inline void* stats_reporter(void *_interval)
+{
+	unsigned long interval = (unsigned long) _interval;
+	unsigned long last_attempts = 0, last_pageouts = 0, last_churned = 0;
+	unsigned long start = now_ns();
+	for (;;) {
+		sleep(interval);
+
+		unsigned long attempts = 0, detections = 0, pageouts = 0;
+		unsigned long churned = 0;
+		unsigned long pin[STATS_HIST_BUCKETS] = { 0 };
+		unsigned long unpin[STATS_HIST_BUCKETS] = { 0 };
+		unsigned long nr = stat_read(&stats->nr_threads);
+		for (unsigned long i = 0; i < nr && i < STATS_MAX_THREADS;
+		     i++) {
+			struct thread_stats *t = &stats->thread[i];
+			attempts += stat_read(&t->attempts);
+			detections += stat_read(&t->detections);
+			pageouts += stat_read(&t->pageouts);
+			churned += stat_read(&t->churned);
+			for (int b = 0; b < STATS_HIST_BUCKETS; b++) {
+				pin[b] += stat_read(&t->pin_hist[b]);
+				unpin[b] += stat_read(&t->unpin_hist[b]);
+			}
+		}
+
+		printf("t=%lus attempts=%lu rate=%lu/s detections=%lu "
+		       "pageouts=%lu pageout_rate=%lu/s churn=%luMiB/s "
+		       "pin_p50=%luns pin_p99=%luns "
+		       "unpin_p50=%luns unpin_p99=%luns\n",
+		       (now_ns() - start) / 1000000000UL,
+		       attempts, (attempts - last_attempts) / interval,
+		       detections, pageouts,
+		       (pageouts - last_pageouts) / interval,
+		       ((churned - last_churned) * PAGE_SIZE >> 20) / interval,
+		       hist_percentile(pin, 50), hist_percentile(pin, 99),
+		       hist_percentile(unpin, 50), hist_percentile(unpin, 99));
+		if (stats_report_hook)
+			stats_report_hook(interval);
+		fflush(stdout);
+		last_attempts = attempts;
+		last_pageouts = pageouts;
+		last_churned = churned;
+	}
+	return NULL;
+}
+
+/* parse a comma separated list of names into a bitmask */
+static inline bool parse_list(const char *list, int (*lookup)(const char *),
+			      unsigned long *mask)
+{
+	char *copy = strdup(list), *save, *tok;
+	if (!copy)
+		perror("strdup"), exit(1);
+	*mask = 0;
+	for (tok = strtok_r(copy, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		int i = lookup(tok);
+		if (i < 0) {
+			free(copy);
+			return false;
+		}
+		*mask |= 1UL << i;
+	}
+	free(copy);
+	return *mask;
+}
+
+/* open the viable VFIO group of a PCI device, or -1 */
+static inline int vfio_get_group(const char *name)
+{
+	int seg, bus, slot, func, groupid;
+	char path[PATH_MAX], iommu_group_path[PATH_MAX];
+	struct vfio_group_status group_status = {
+		.argsz = sizeof(group_status)
+	};
+
+	if (sscanf(name, "%04x:%02x:%02x.%d", &seg, &bus, &slot, &func) != 4)
+		return -1;
+	snprintf(path, sizeof(path),
+		 "/sys/bus/pci/devices/%04x:%02x:%02x.%01x/iommu_group",
+		 seg, bus, slot, func);
+	ssize_t len = readlink(path, iommu_group_path,
+			       sizeof(iommu_group_path) - 1);
+	if (len <= 0)
+		return -1;
+	iommu_group_path[len] = 0;
+	if (sscanf(basename(iommu_group_path), "%d", &groupid) != 1)
+		return -1;
+
+	snprintf(path, sizeof(path), "/dev/vfio/%d", groupid);
+	int group = open(path, O_RDWR);
+	if (group < 0)
+		return -1;
+	if (ioctl(group, VFIO_GROUP_GET_STATUS, &group_status) ||
+	    !(group_status.flags & VFIO_GROUP_FLAGS_VIABLE)) {
+		close(group);
+		return -1;
+	}
+	return group;
+}
+
+#endif
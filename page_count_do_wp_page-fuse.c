@@ -0,0 +1,402 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ *  reproducer for v5.11 (still works on v5.15-rc3) memory corruption
+ *  with page_count instead of mapcount in do_wp_page, with the
+ *  direct I/O pin held open by an in-process FUSE server.
+ *
+ *  Copyright (C) 2021  Red Hat, Inc.
+ *
+ *  gcc -O2 -o page_count_do_wp_page-fuse page_count_do_wp_page-fuse.c -lpthread
+ *  ./page_count_do_wp_page-fuse [--perturb=clear_refs|mprotect|pageout|none] \
+ *	[--hold=USEC] [--iterations=N]
+ *
+ *  The reproducer mounts its own FUSE filesystem on a temporary
+ *  directory, talking the /dev/fuse protocol directly, with a single
+ *  file opened with FOPEN_DIRECT_IO. A read() of that file pins the
+ *  race page with GUP and stays pinned until the server replies.
+ *  The server parks every READ request and signals the controller
+ *  thread, which injects the --perturb event on the race page
+ *  (clear_refs by default), writes to it, optionally keeps the pin
+ *  held for --hold microseconds more and then tells the server to
+ *  reply with zeroes. A kernel that COWs the pinned page lets the
+ *  reply land in the old copy.
+ *
+ *  The process exits with 2 at the first detection and with 0 after
+ *  --iterations (default 100) clean reads, with a warning if not all
+ *  of them were parked. The filesystem is detached with MNT_DETACH at
+ *  exit, also on SIGINT and SIGTERM.
+ *
+ *  Mounting needs root. clear_refs needs CONFIG_SOFT_DIRTY=y.
+ *
+ *  This is caused by the VM design flaw introduced in commit
+ *  09854ba94c6aad7886996bfbee2530b3d8a7f4f4.
+ *
+ *  Fixed in https://gitlab.com/aarcange/aa/-/tree/mapcount_unshare
+ */
+
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <linux/fuse.h>
+
+#define PAGE_SIZE (1UL<<12)
+/*
+ * NOTE: an arch with a PAGE_SIZE > 4k will reproduce the silent mm
+ * corruption with an HARDBLKSIZE of 4k or more.
+ */
+#define HARDBLKSIZE 512
+
+#define FUSE_ROOT_INO 1
+#define FUSE_FILE_INO 2
+#define FUSE_FILE_NAME "race"
+#define FUSE_BUF_SIZE (FUSE_MIN_READ_BUFFER + (128UL<<10))
+
+enum perturb {
+	PERTURB_CLEAR_REFS,
+	PERTURB_MPROTECT,
+	PERTURB_PAGEOUT,
+	PERTURB_NONE,
+};
+
+static const char *perturb_names[] = {
+	[PERTURB_CLEAR_REFS] = "clear_refs",
+	[PERTURB_MPROTECT] = "mprotect",
+	[PERTURB_PAGEOUT] = "pageout",
+	[PERTURB_NONE] = "none",
+};
+
+static enum perturb perturb_mode;
+static unsigned long hold_us;
+static int clear_refs_fd;
+static char *mem;
+
+/* server -> controller: a READ is parked, controller -> server: reply */
+static int parked_fds[2], release_fds[2];
+static unsigned long parks;
+
+static char mountpoint[] = "/tmp/page_count_do_wp_page-fuse-XXXXXX";
+static bool mounted;
+
+static void fuse_unmount(void)
+{
+	if (!mounted)
+		return;
+	mounted = false;
+	umount2(mountpoint, MNT_DETACH);
+	rmdir(mountpoint);
+}
+
+static void fuse_unmount_signal(int sig)
+{
+	fuse_unmount();
+	_exit(1);
+}
+
+static void fuse_reply(int fuse_fd, uint64_t unique, int error,
+		       const void *data, size_t size)
+{
+	struct fuse_out_header out = {
+		.len = sizeof(out) + size,
+		.error = error,
+		.unique = unique,
+	};
+	struct iovec iov[2] = {
+		{ .iov_base = &out, .iov_len = sizeof(out) },
+		{ .iov_base = (void *) data, .iov_len = size },
+	};
+	/* ENOENT means the request was interrupted meanwhile */
+	if (writev(fuse_fd, iov, 2) < 0 && errno != ENOENT)
+		perror("write /dev/fuse"), exit(1);
+}
+
+static void fuse_fill_attr(uint64_t ino, struct fuse_attr *attr)
+{
+	memset(attr, 0, sizeof(*attr));
+	attr->ino = ino;
+	attr->nlink = 1;
+	attr->blksize = PAGE_SIZE;
+	if (ino == FUSE_ROOT_INO)
+		attr->mode = S_IFDIR | 0755;
+	else {
+		attr->mode = S_IFREG | 0600;
+		attr->size = PAGE_SIZE;
+		attr->blocks = PAGE_SIZE / 512;
+	}
+}
+
+/* park the read until the controller is done with the pinned page */
+static void fuse_read(int fuse_fd, struct fuse_in_header *in)
+{
+	struct fuse_read_in *read_in = (struct fuse_read_in *)(in + 1);
+	static char zero[PAGE_SIZE];
+	size_t size = 0;
+	char c = 0;
+
+	if (read_in->offset < PAGE_SIZE) {
+		size = PAGE_SIZE - read_in->offset;
+		if (size > read_in->size)
+			size = read_in->size;
+	}
+	if (write(parked_fds[1], &c, 1) != 1 ||
+	    read(release_fds[0], &c, 1) != 1)
+		perror("fuse park"), exit(1);
+	fuse_reply(fuse_fd, in->unique, 0, zero, size);
+}
+
+static void* fuse_server(void *data)
+{
+	int fuse_fd = (long) data;
+	char *buf = malloc(FUSE_BUF_SIZE);
+	if (!buf)
+		perror("malloc"), exit(1);
+
+	for (;;) {
+		ssize_t ret = read(fuse_fd, buf, FUSE_BUF_SIZE);
+		if (ret < 0 && (errno == EINTR || errno == ENOENT))
+			continue;
+		if (ret < 0 && errno == ENODEV)
+			break;
+		if (ret < (ssize_t) sizeof(struct fuse_in_header))
+			perror("read /dev/fuse"), exit(1);
+
+		struct fuse_in_header *in = (struct fuse_in_header *) buf;
+		void *arg = in + 1;
+		switch (in->opcode) {
+		case FUSE_INIT: {
+			struct fuse_init_in *init_in = arg;
+			struct fuse_init_out init_out = {
+				.major = FUSE_KERNEL_VERSION,
+				.minor = FUSE_KERNEL_MINOR_VERSION,
+				.max_readahead = init_in->max_readahead,
+				.max_write = PAGE_SIZE,
+				.time_gran = 1,
+			};
+			if (init_in->major != FUSE_KERNEL_VERSION)
+				fprintf(stderr, "FUSE major %u unsupported\n",
+					init_in->major), exit(1);
+			if (init_in->minor < init_out.minor)
+				init_out.minor = init_in->minor;
+			fuse_reply(fuse_fd, in->unique, 0, &init_out,
+				   sizeof(init_out));
+			break;
+		}
+		case FUSE_LOOKUP: {
+			struct fuse_entry_out entry = {
+				.nodeid = FUSE_FILE_INO,
+			};
+			if (in->nodeid != FUSE_ROOT_INO ||
+			    strcmp(arg, FUSE_FILE_NAME)) {
+				fuse_reply(fuse_fd, in->unique, -ENOENT,
+					   NULL, 0);
+				break;
+			}
+			fuse_fill_attr(FUSE_FILE_INO, &entry.attr);
+			fuse_reply(fuse_fd, in->unique, 0, &entry,
+				   sizeof(entry));
+			break;
+		}
+		case FUSE_GETATTR: {
+			struct fuse_attr_out attr_out = { 0 };
+			fuse_fill_attr(in->nodeid, &attr_out.attr);
+			fuse_reply(fuse_fd, in->unique, 0, &attr_out,
+				   sizeof(attr_out));
+			break;
+		}
+		case FUSE_OPEN:
+		case FUSE_OPENDIR: {
+			struct fuse_open_out open_out = {
+				.fh = in->nodeid,
+				/* no page cache, reads pin the user pages */
+				.open_flags = FOPEN_DIRECT_IO,
+			};
+			fuse_reply(fuse_fd, in->unique, 0, &open_out,
+				   sizeof(open_out));
+			break;
+		}
+		case FUSE_READ:
+			fuse_read(fuse_fd, in);
+			break;
+		case FUSE_RELEASE:
+		case FUSE_RELEASEDIR:
+		case FUSE_FLUSH:
+		case FUSE_DESTROY:
+			fuse_reply(fuse_fd, in->unique, 0, NULL, 0);
+			break;
+		case FUSE_FORGET:
+		case FUSE_BATCH_FORGET:
+		case FUSE_INTERRUPT:
+			/* no reply */
+			break;
+		default:
+			fuse_reply(fuse_fd, in->unique, -ENOSYS, NULL, 0);
+			break;
+		}
+	}
+	free(buf);
+	return NULL;
+}
+
+static void fuse_mount(void)
+{
+	int fuse_fd = open("/dev/fuse", O_RDWR|O_CLOEXEC);
+	if (fuse_fd < 0)
+		perror("open /dev/fuse"), exit(1);
+	if (!mkdtemp(mountpoint))
+		perror("mkdtemp"), exit(1);
+
+	char opts[128];
+	snprintf(opts, sizeof(opts), "fd=%d,rootmode=40000,user_id=%d,"
+		 "group_id=%d", fuse_fd, getuid(), getgid());
+	if (mount("page_count_do_wp_page", mountpoint, "fuse",
+		  MS_NOSUID|MS_NODEV, opts))
+		perror("mount fuse"), rmdir(mountpoint), exit(1);
+	mounted = true;
+	atexit(fuse_unmount);
+	signal(SIGINT, fuse_unmount_signal);
+	signal(SIGTERM, fuse_unmount_signal);
+
+	pthread_t server;
+	if (pthread_create(&server, NULL, fuse_server, (void *)(long) fuse_fd))
+		perror("pthread_create server"), exit(1);
+}
+
+/* runs while the READ is parked with the race page pinned */
+static void* controller(void *data)
+{
+	volatile char *page = mem;
+	char c;
+	for (;;) {
+		if (read(parked_fds[0], &c, 1) != 1)
+			perror("read parked"), exit(1);
+
+		switch (perturb_mode) {
+		case PERTURB_CLEAR_REFS:
+			if (write(clear_refs_fd, "4", 1) != 1)
+				perror("write soft dirty"), exit(1);
+			break;
+		case PERTURB_MPROTECT:
+			if (mprotect(mem, PAGE_SIZE, PROT_READ) ||
+			    mprotect(mem, PAGE_SIZE, PROT_READ|PROT_WRITE))
+				perror("mprotect"), exit(1);
+			break;
+		case PERTURB_PAGEOUT:
+			if (madvise(mem, PAGE_SIZE, MADV_PAGEOUT))
+				perror("madvise PAGEOUT"), exit(1);
+			break;
+		case PERTURB_NONE:
+			break;
+		}
+		/* the write fault that must not COW the pinned page */
+		char x = page[PAGE_SIZE-1];
+		page[PAGE_SIZE-1] = x;
+		if (hold_us)
+			usleep(hold_us);
+
+		parks++;
+		if (write(release_fds[1], &c, 1) != 1)
+			perror("write release"), exit(1);
+	}
+	return NULL;
+}
+
+static bool check_page(char *mem, unsigned long iteration)
+{
+	if (!memcmp(mem, mem+PAGE_SIZE, HARDBLKSIZE))
+		return false;
+	if (memcmp(mem, mem+PAGE_SIZE*2, HARDBLKSIZE)) {
+		printf("unexpected memory corruption detected at iteration "
+		       "%lu, dumping page\n", iteration);
+		for (unsigned int i = 0; i < HARDBLKSIZE; i++)
+			printf("%x", mem[i]);
+		printf("\n");
+	} else
+		printf("memory corruption detected at iteration %lu\n",
+		       iteration);
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long iterations = 100;
+	bool usage = false;
+	for (int i = 1; i < argc; i++) {
+		if (!strncmp(argv[i], "--perturb=", 10)) {
+			unsigned int p;
+			for (p = 0; p < sizeof(perturb_names) /
+				     sizeof(perturb_names[0]); p++)
+				if (!strcmp(argv[i] + 10, perturb_names[p]))
+					break;
+			usage |= p == sizeof(perturb_names) /
+				sizeof(perturb_names[0]);
+			perturb_mode = p;
+		} else if (!strncmp(argv[i], "--hold=", 7))
+			hold_us = strtoul(argv[i] + 7, NULL, 0);
+		else if (!strncmp(argv[i], "--iterations=", 13)) {
+			iterations = strtoul(argv[i] + 13, NULL, 0);
+			usage |= !iterations;
+		} else
+			usage = true;
+	}
+	if (usage)
+		printf("%s [--perturb=clear_refs|mprotect|pageout|none] "
+		       "[--hold=USEC] [--iterations=N]\n", argv[0]), exit(1);
+
+	if (posix_memalign((void **)&mem, PAGE_SIZE, PAGE_SIZE*3))
+		perror("posix_memalign"), exit(1);
+	/* THP is not using page_count so it would not corrupt memory */
+	if (madvise(mem, PAGE_SIZE*3, MADV_NOHUGEPAGE))
+		perror("madvise"), exit(1);
+	bzero(mem, PAGE_SIZE*3);
+	memset(mem + PAGE_SIZE*2, 0xff, HARDBLKSIZE);
+
+	clear_refs_fd = open("/proc/self/clear_refs", O_WRONLY);
+	if (clear_refs_fd < 0 && perturb_mode == PERTURB_CLEAR_REFS)
+		perror("open clear_refs"), exit(1);
+	if (pipe(parked_fds) || pipe(release_fds))
+		perror("pipe"), exit(1);
+
+	fuse_mount();
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, controller, NULL))
+		perror("pthread_create controller"), exit(1);
+
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/" FUSE_FILE_NAME, mountpoint);
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		perror("open fuse file"), exit(1);
+
+	printf("fuse=%s perturb=%s hold=%luus iterations=%lu\n", mountpoint,
+	       perturb_names[perturb_mode], hold_us, iterations);
+	fflush(stdout);
+
+	for (unsigned long i = 0; i < iterations; i++) {
+		/* the pre-read content stays visible if the read is lost */
+		memset(mem, 0xff, HARDBLKSIZE);
+		if (pread(fd, mem, HARDBLKSIZE, 0) != HARDBLKSIZE)
+			perror("read"), exit(1);
+		if (check_page(mem, i)) {
+			fflush(stdout);
+			exit(2);
+		}
+	}
+	/* the release pipe orders parks before the read returned */
+	if (parks != iterations)
+		printf("WARNING: only %lu of %lu reads were parked with the "
+		       "page pinned\n", parks, iterations);
+	printf("no corruption in %lu iterations\n", iterations);
+	close(fd);
+	return 0;
+}
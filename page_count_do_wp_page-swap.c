@@ -7,9 +7,48 @@
  *  Copyright (C) 2021  Red Hat, Inc.
  *
  *  gcc -O2 -o page_count_do_wp_page-swap page_count_do_wp_page-swap.c -lpthread
- *  ./page_count_do_wp_page-swap ./whateverfile
+ *  ./page_count_do_wp_page-swap [--cgroup[=MiB]] [--pages=N] \
+ *	[--advice=pageout|cold] [--pageout-rate=N] [--pageout-sync] \
+ *	[--pageout-target=PID:ADDR:LEN] \
+ *	[--placement=smt|llc|cross-llc|cross-node] [--ramdisk] \
+ *	[--sample[=N]] ./whateverfile
  *
- *  NOTE: swap must be enabled.
+ *  NOTE: swap must be enabled. The swap pressure comes from a region
+ *  larger than the available memory kept rotating through swap; the
+ *  MiB/s it pushes out is printed every 10 seconds.
+ *
+ *  --cgroup runs the reproducer inside its own cgroup v2 with a
+ *  memory.max of MiB (default 256) and only applies swap pressure
+ *  inside it, instead of swapping the whole host. It requires root
+ *  and the cgroup v2 hierarchy mounted at /sys/fs/cgroup.
+ *
+ *  --pages reads N page triplets (up to UIO_MAXIOV) with one preadv().
+ *  The pageout thread covers all of them with vectored
+ *  process_madvise() calls using --advice (MADV_PAGEOUT by default).
+ *  It issues --pageout-rate calls per second, or one after every pin
+ *  with --pageout-sync, or at random intervals if neither is set.
+ *  --pageout-target aims the pageout thread at LEN bytes at ADDR in
+ *  another process instead of the local race pages.
+ *  process_madvise() requires v5.10, and CAP_SYS_NICE before v6.13.
+ *  Without either the local pages fall back to one madvise() per page.
+ *
+ *  --ramdisk reads from a loop device over tmpfs set up on the fly,
+ *  so every pin lasts microseconds instead of the latency of the
+ *  disk. It needs root and falls back to the file given on the
+ *  command line.
+ *
+ *  --sample runs a thread that keeps sampling the state of the race
+ *  pages from /proc/self/pagemap, /proc/kpagecount and
+ *  /proc/kpageflags into a ring of the last N samples (default 64):
+ *  PFN or swap entry, soft-dirty, exclusive, mapcount and swapcache.
+ *  The ring is dumped after every detection. It needs root.
+ *
+ *  --placement pins the reader, the writer and the pageout
+ *  thread according to the CPU topology: "smt" puts reader and writer
+ *  on SMT siblings, "llc" on different cores of the same LLC,
+ *  "cross-llc" on different LLCs and "cross-node" on different NUMA
+ *  nodes. The perturber always shares the LLC of the reader. The CPUs
+ *  chosen are printed on a "placement policy=" line.
  *
  *  This is caused by the VM design flaw introduced in commit
  *  09854ba94c6aad7886996bfbee2530b3d8a7f4f4.
@@ -25,7 +64,21 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <sched.h>
+#include <dirent.h>
+#include <signal.h>
+#include <errno.h>
+#include <limits.h>
 #include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
+#include <linux/kernel-page-flags.h>
+#include "page_count_do_wp_page-common.h"
 
 #define PAGE_SIZE (1UL<<12)
 /*
@@ -33,59 +86,429 @@
  * corruption with an HARDBLKSIZE of 4k or more.
  */
 #define HARDBLKSIZE 512
+#define CGROUP_DEFAULT_MAX (256UL<<20)
 
-static void* writer(void *_mem)
+#ifndef __NR_pidfd_open
+#define __NR_pidfd_open 434
+#endif
+#ifndef __NR_process_madvise
+#define __NR_process_madvise 440
+#endif
+/* the race pages, one every three pages, each followed by its checks */
+struct race_pages {
+	char *mem;
+	unsigned long nr;
+	/* bumped by the reader before every preadv */
+	unsigned long pin_seq;
+};
+
+static inline char *race_page(struct race_pages *race, unsigned long i)
 {
-	volatile char *mem = (char *)_mem;
+	return race->mem + i * PAGE_SIZE*3;
+}
+
+static void* writer(void *_race)
+{
+	struct race_pages *race = _race;
+	volatile char *mem;
 	char x;
 	for(;;) {
-		usleep(random() % 1000);
+		random_delay_us(1000);
+		mem = race_page(race, rng_next() % race->nr);
 		x = mem[PAGE_SIZE-1];
 		mem[PAGE_SIZE-1] = x;
 	}
 	return NULL;
 }
 
-static void* background_pageout(void *_mem)
+struct pageout_engine {
+	int pidfd;
+	bool remote;
+	bool fallback;
+	int advice;
+	struct iovec *iov;
+	unsigned long nr_iov;
+	/* calls per second, or zero for random intervals */
+	unsigned long rate;
+	/* burst right after the reader started a pin */
+	bool sync;
+	unsigned long *pin_seq;
+};
+
+static void pageout_issue(struct pageout_engine *engine)
+{
+	for (unsigned long off = 0; off < engine->nr_iov; off += UIO_MAXIOV) {
+		unsigned long nr = engine->nr_iov - off;
+		if (nr > UIO_MAXIOV)
+			nr = UIO_MAXIOV;
+		if (!engine->fallback &&
+		    syscall(__NR_process_madvise, engine->pidfd,
+			    engine->iov + off, nr, engine->advice, 0) >= 0)
+			continue;
+		if (!engine->fallback) {
+			/* before v6.13 even the own pidfd needs CAP_SYS_NICE */
+			if (engine->remote || (errno != ENOSYS &&
+					       errno != EINVAL &&
+					       errno != EPERM))
+				perror("process_madvise"), exit(1);
+			printf("process_madvise unavailable, "
+			       "falling back to madvise\n");
+			engine->fallback = true;
+		}
+		for (unsigned long i = off; i < off + nr; i++)
+			madvise(engine->iov[i].iov_base, engine->iov[i].iov_len,
+				engine->advice);
+	}
+}
+
+static void* background_pageout(void *_engine)
 {
-	char *mem = (char *)_mem;
+	struct pageout_engine *engine = _engine;
+	unsigned long seq = 0, next = now_ns();
 	for(;;) {
-		usleep(random() % 1000);
-		madvise(mem, PAGE_SIZE, MADV_PAGEOUT);
+		if (engine->sync) {
+			unsigned long cur;
+			while ((cur = __atomic_load_n(engine->pin_seq,
+						      __ATOMIC_ACQUIRE)) == seq)
+				cpu_relax();
+			seq = cur;
+		} else if (engine->rate) {
+			/* pace against absolute deadlines, not call cost */
+			next += 1000000000UL / engine->rate;
+			unsigned long now = now_ns();
+			if (next > now)
+				delay_ns(next - now);
+			else
+				next = now;
+		} else
+			random_delay_us(1000);
+		pageout_issue(engine);
 	}
 	return NULL;
 }
 
+/* the MiB/s pushed out by the churn engine is printed every period */
+#define CHURN_REPORT_NS (10 * 1000000000UL)
+
 static void* background_swap(void *_size)
 {
-	unsigned long size = (unsigned long) _size;
+	struct swap_churn churn;
+	unsigned long churned = 0, start = now_ns();
+	churn_init(&churn, (unsigned long) _size);
+	for (;;) {
+		churned += churn_step(&churn);
+		unsigned long now = now_ns();
+		if (now - start >= CHURN_REPORT_NS) {
+			printf("swap churn %.0f MiB/s\n",
+			       (churned >> 20) / ((now - start) / 1e9));
+			fflush(stdout);
+			churned = 0;
+			start = now;
+		}
+	}
+	return NULL;
+}
+
+static bool check_page(char *mem, bool skip_memset)
+{
+	if (memcmp(mem, mem+PAGE_SIZE, HARDBLKSIZE)) {
+		if (memcmp(mem, mem+PAGE_SIZE*2, PAGE_SIZE)) {
+			if (skip_memset)
+				printf("unexpected memory "
+				       "corruption detected\n");
+			else
+				printf("memory corruption detected, "
+				       "dumping page\n");
+			int end = PAGE_SIZE;
+			if (!memcmp(mem+HARDBLKSIZE, mem+PAGE_SIZE,
+				    PAGE_SIZE-HARDBLKSIZE))
+				end = HARDBLKSIZE;
+			for (int i = 0; i < end; i++)
+				printf("%x", mem[i]);
+			printf("\n");
+		} else
+			printf("memory corruption detected\n");
+		return true;
+	}
+	return false;
+}
+
+/*
+ * Page state sampler for --sample. A thread keeps taking snapshots of
+ * the kernel state of the race pages: one pread() of /proc/self/pagemap
+ * covers all of them, then /proc/kpagecount and /proc/kpageflags are
+ * read at the PFN of every present page, all into buffers allocated
+ * upfront. Every page of every snapshot goes into a ring of the last N
+ * samples, tagged with the pin it overlapped. The slots are published
+ * with a sequence count, so the reader can dump the ring when it
+ * detects corruption without stopping the sampler, skipping slots
+ * that were being rewritten.
+ *
+ * The page_count is not exported to userland, only the mapcount in
+ * kpagecount: a pinned page shows up as a page whose mapcount does
+ * not change across a COW.
+ */
+#define SAMPLE_DEFAULT_SLOTS 64
+
+#define PM_PFN_MASK ((1ULL<<55) - 1)
+#define PM_SOFT_DIRTY (1ULL<<55)
+#define PM_EXCLUSIVE (1ULL<<56)
+#define PM_SWAP (1ULL<<62)
+#define PM_PRESENT (1ULL<<63)
+
+struct page_sample {
+	unsigned long gen;
+	unsigned long ns;
+	unsigned long pin_seq;
+	unsigned long page;
+	uint64_t pagemap;
+	uint64_t mapcount;
+	uint64_t flags;
+};
+
+struct page_sampler {
+	struct race_pages *race;
+	int pagemap_fd, kpagecount_fd, kpageflags_fd;
+	uint64_t *pagemap;
+	struct page_sample *ring;
+	unsigned long nr_slots;
+	/* samples written so far, the next slot is head % nr_slots */
+	unsigned long head;
+};
+
+static void sampler_init(struct page_sampler *sampler,
+			 struct race_pages *race, unsigned long nr_slots)
+{
+	sampler->race = race;
+	sampler->nr_slots = nr_slots;
+	sampler->pagemap_fd = open("/proc/self/pagemap", O_RDONLY);
+	if (sampler->pagemap_fd < 0)
+		perror("open pagemap"), exit(1);
+	/* both need CAP_SYS_ADMIN, which also unhides the PFNs */
+	sampler->kpagecount_fd = open("/proc/kpagecount", O_RDONLY);
+	if (sampler->kpagecount_fd < 0)
+		perror("open kpagecount"), exit(1);
+	sampler->kpageflags_fd = open("/proc/kpageflags", O_RDONLY);
+	if (sampler->kpageflags_fd < 0)
+		perror("open kpageflags"), exit(1);
+	sampler->pagemap = calloc(race->nr * 3, sizeof(*sampler->pagemap));
+	sampler->ring = calloc(nr_slots, sizeof(*sampler->ring));
+	if (!sampler->pagemap || !sampler->ring)
+		perror("calloc"), exit(1);
+}
+
+static void sampler_store(struct page_sampler *sampler,
+			  const struct page_sample *sample)
+{
+	unsigned long head = sampler->head;
+	struct page_sample *slot = &sampler->ring[head % sampler->nr_slots];
+	/* odd while the slot is being rewritten */
+	__atomic_store_n(&slot->gen, 2 * head + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	slot->ns = sample->ns;
+	slot->pin_seq = sample->pin_seq;
+	slot->page = sample->page;
+	slot->pagemap = sample->pagemap;
+	slot->mapcount = sample->mapcount;
+	slot->flags = sample->flags;
+	__atomic_store_n(&slot->gen, 2 * head + 2, __ATOMIC_RELEASE);
+	__atomic_store_n(&sampler->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void* background_sampler(void *data)
+{
+	struct page_sampler *sampler = data;
+	struct race_pages *race = sampler->race;
+	size_t len = race->nr * 3 * sizeof(*sampler->pagemap);
+	off_t offset = (unsigned long) race->mem / PAGE_SIZE *
+		sizeof(*sampler->pagemap);
 	for (;;) {
-		volatile char *p = malloc(size);
-		if (!p)
-			perror("malloc"), exit(1);
-		for (unsigned long i = 0; i < size; i += PAGE_SIZE) {
-			p[i] = 0;
+		struct page_sample sample;
+		sample.pin_seq = __atomic_load_n(&race->pin_seq,
+						 __ATOMIC_ACQUIRE);
+		sample.ns = now_ns();
+		if (pread(sampler->pagemap_fd, sampler->pagemap, len,
+			  offset) != len)
+			perror("read pagemap"), exit(1);
+		for (unsigned long i = 0; i < race->nr; i++) {
+			sample.page = i;
+			sample.pagemap = sampler->pagemap[i * 3];
+			sample.mapcount = sample.flags = 0;
+			uint64_t pfn = sample.pagemap & PM_PFN_MASK;
+			if (sample.pagemap & PM_PRESENT && pfn) {
+				off_t pfn_offset = pfn * sizeof(uint64_t);
+				if (pread(sampler->kpagecount_fd,
+					  &sample.mapcount, sizeof(uint64_t),
+					  pfn_offset) != sizeof(uint64_t) ||
+				    pread(sampler->kpageflags_fd,
+					  &sample.flags, sizeof(uint64_t),
+					  pfn_offset) != sizeof(uint64_t))
+					perror("read kpage"), exit(1);
+			}
+			sampler_store(sampler, &sample);
 		}
-		free((void *)p);
 	}
 	return NULL;
 }
 
+/* print the ring oldest first, ages relative to now */
+static void sampler_dump(struct page_sampler *sampler, unsigned long pin_seq)
+{
+	unsigned long now = now_ns();
+	unsigned long head = __atomic_load_n(&sampler->head, __ATOMIC_ACQUIRE);
+	unsigned long first = head > sampler->nr_slots ?
+		head - sampler->nr_slots : 0;
+	printf("last %lu page samples, detection at pin %lu:\n",
+	       head - first, pin_seq);
+	for (unsigned long i = first; i < head; i++) {
+		struct page_sample *slot = &sampler->ring[i % sampler->nr_slots];
+		struct page_sample sample;
+		unsigned long gen = __atomic_load_n(&slot->gen,
+						    __ATOMIC_ACQUIRE);
+		sample = *slot;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (gen != 2 * i + 2 ||
+		    __atomic_load_n(&slot->gen, __ATOMIC_RELAXED) != gen)
+			continue;
+
+		printf("  -%luns pin=%lu page=%lu", now - sample.ns,
+		       sample.pin_seq, sample.page);
+		if (sample.pagemap & PM_PRESENT)
+			printf(" pfn=0x%llx mapcount=%llu",
+			       (unsigned long long) (sample.pagemap &
+						     PM_PFN_MASK),
+			       (unsigned long long) sample.mapcount);
+		else if (sample.pagemap & PM_SWAP)
+			printf(" swap=%llu:0x%llx",
+			       (unsigned long long) (sample.pagemap & 0x1f),
+			       (unsigned long long) ((sample.pagemap &
+						      PM_PFN_MASK) >> 5));
+		else
+			printf(" none");
+		if (sample.pagemap & PM_SOFT_DIRTY)
+			printf(" soft-dirty");
+		if (sample.pagemap & PM_EXCLUSIVE)
+			printf(" exclusive");
+		if (sample.flags & 1ULL << KPF_SWAPCACHE)
+			printf(" swapcache");
+		if (sample.flags & 1ULL << KPF_WRITEBACK)
+			printf(" writeback");
+		if (sample.flags & 1ULL << KPF_LOCKED)
+			printf(" locked");
+		if (sample.flags & 1ULL << KPF_DIRTY)
+			printf(" dirty");
+		printf("\n");
+	}
+}
+
 int main(int argc, char *argv[])
 {
-	if (argc < 2)
-		printf("%s <filename>\n", argv[0]), exit(1);
+	const char *filename = NULL;
+	bool use_ramdisk = false;
+	unsigned long cgroup_max = 0;
+	struct race_pages race = { .nr = 1 };
+	struct pageout_engine engine = { .advice = MADV_PAGEOUT };
+	pid_t target_pid = 0;
+	unsigned long target_addr = 0, target_len = 0, sample_slots = 0;
+	for (int i = 1; i < argc; i++) {
+		if (!strncmp(argv[i], "--pages=", 8)) {
+			race.nr = strtoul(argv[i] + 8, NULL, 0);
+			if (!race.nr || race.nr > UIO_MAXIOV)
+				printf("invalid number of pages\n"), exit(1);
+		} else if (!strcmp(argv[i], "--advice=pageout"))
+			engine.advice = MADV_PAGEOUT;
+		else if (!strcmp(argv[i], "--advice=cold"))
+			engine.advice = MADV_COLD;
+		else if (!strncmp(argv[i], "--pageout-rate=", 15))
+			engine.rate = strtoul(argv[i] + 15, NULL, 0);
+		else if (!strcmp(argv[i], "--pageout-sync"))
+			engine.sync = true;
+		else if (!strncmp(argv[i], "--pageout-target=", 17)) {
+			if (sscanf(argv[i] + 17, "%d:%li:%li", &target_pid,
+				   &target_addr, &target_len) != 3 ||
+			    target_pid <= 0 || !target_len)
+				printf("invalid pageout target\n"), exit(1);
+		} else if (!strcmp(argv[i], "--ramdisk"))
+			use_ramdisk = true;
+		else if (!strcmp(argv[i], "--sample"))
+			sample_slots = SAMPLE_DEFAULT_SLOTS;
+		else if (!strncmp(argv[i], "--sample=", 9)) {
+			sample_slots = strtoul(argv[i] + 9, NULL, 0);
+			if (!sample_slots)
+				printf("invalid number of samples\n"), exit(1);
+		} else if (!strncmp(argv[i], "--placement=", 12)) {
+			placement = placement_lookup(argv[i] + 12);
+			if (!placement)
+				printf("invalid placement\n"), exit(1);
+		} else if (!strcmp(argv[i], "--cgroup"))
+			cgroup_max = CGROUP_DEFAULT_MAX;
+		else if (!strncmp(argv[i], "--cgroup=", 9)) {
+			cgroup_max = strtoul(argv[i] + 9, NULL, 0) << 20;
+			if (!cgroup_max)
+				printf("invalid cgroup size\n"), exit(1);
+		} else if (!filename)
+			filename = argv[i];
+		else {
+			filename = NULL;
+			break;
+		}
+	}
+	if (!filename || (engine.sync && engine.rate))
+		printf("%s [--cgroup[=MiB]] [--pages=N] [--advice=pageout|cold] "
+		       "[--pageout-rate=N | --pageout-sync] "
+		       "[--pageout-target=PID:ADDR:LEN] "
+		       "[--placement=smt|llc|cross-llc|cross-node] [--ramdisk] "
+		       "[--sample[=N]] <filename>\n",
+		       argv[0]), exit(1);
+
+	if (cgroup_max)
+		cgroup_sandbox("page_count_do_wp_page-swap", cgroup_max);
 
 	char *mem;
-	if (posix_memalign((void **)&mem, PAGE_SIZE, PAGE_SIZE*3))
+	if (posix_memalign((void **)&mem, PAGE_SIZE, PAGE_SIZE*3*race.nr))
 		perror("posix_memalign"), exit(1);
+	race.mem = mem;
 
 	/* THP is not using page_count so it would not corrupt memory */
-	if (madvise(mem, PAGE_SIZE, MADV_NOHUGEPAGE))
+	if (madvise(mem, PAGE_SIZE*3*race.nr, MADV_NOHUGEPAGE))
 		perror("madvise"), exit(1);
 
-	bzero(mem, PAGE_SIZE * 3);
-	memset(mem + PAGE_SIZE * 2, 0xff, HARDBLKSIZE);
+	bzero(mem, PAGE_SIZE*3*race.nr);
+	struct iovec *read_iov = calloc(race.nr, sizeof(*read_iov));
+	if (!read_iov)
+		perror("calloc"), exit(1);
+	for (unsigned long i = 0; i < race.nr; i++) {
+		memset(race_page(&race, i) + PAGE_SIZE * 2, 0xff, HARDBLKSIZE);
+		read_iov[i].iov_base = race_page(&race, i);
+		read_iov[i].iov_len = HARDBLKSIZE;
+	}
+
+	engine.pin_seq = &race.pin_seq;
+	engine.remote = target_pid;
+	engine.pidfd = syscall(__NR_pidfd_open,
+			       engine.remote ? target_pid : getpid(), 0);
+	if (engine.pidfd < 0) {
+		if (engine.remote)
+			perror("pidfd_open"), exit(1);
+		engine.fallback = true;
+	}
+	if (engine.remote) {
+		engine.nr_iov = 1;
+		engine.iov = calloc(1, sizeof(*engine.iov));
+		if (!engine.iov)
+			perror("calloc"), exit(1);
+		engine.iov[0].iov_base = (void *) target_addr;
+		engine.iov[0].iov_len = target_len;
+	} else {
+		engine.nr_iov = race.nr;
+		engine.iov = calloc(race.nr, sizeof(*engine.iov));
+		if (!engine.iov)
+			perror("calloc"), exit(1);
+		for (unsigned long i = 0; i < race.nr; i++) {
+			engine.iov[i].iov_base = race_page(&race, i);
+			engine.iov[i].iov_len = PAGE_SIZE;
+		}
+	}
 
 	/*
 	 * This is not specific to O_DIRECT. Even if O_DIRECT was
@@ -96,74 +519,72 @@ int main(int argc, char *argv[])
 	 * iov_iter_get_pages internally to create transient GUP pins
 	 * on anon memory.
 	 */
-	int fd = open(argv[1], O_DIRECT|O_CREAT|O_RDWR|O_TRUNC, 0600);
+	if (use_ramdisk)
+		filename = ramdisk(filename, race.nr * HARDBLKSIZE);
+	int fd = open(filename, O_DIRECT|O_CREAT|O_RDWR|O_TRUNC, 0600);
 	if (fd < 0)
 		perror("open"), exit(1);
-	if (write(fd, mem, PAGE_SIZE) != PAGE_SIZE)
-		perror("write"), exit(1);
-
-	FILE *file = fopen("/proc/meminfo", "r");
-	if (!file)
-		perror("fopen meminfo"), exit(1);
-
-	char *line = NULL;
-	size_t len = 0;
-	unsigned long mem_free = 0, swap_total = 0, swap_free = 0;
-	int match = 0;
-	while (getline(&line, &len, file) > 0) {
-		if (sscanf(line, "MemFree: %lu kB", &mem_free))
-			match++;
-		if (sscanf(line, "SwapTotal: %lu kB", &swap_total))
-			match++;
-		if (sscanf(line, "SwapFree: %lu kB", &swap_free)) {
-			match++;
-			break;
-		}
-	}
-	if (match != 3 || swap_free > swap_total || !mem_free)
+	/* one zero block per page, read back by preadv */
+	for (unsigned long i = 0; i < race.nr; i += PAGE_SIZE / HARDBLKSIZE)
+		if (write(fd, mem + PAGE_SIZE, PAGE_SIZE) != PAGE_SIZE)
+			perror("write"), exit(1);
+
+	struct meminfo mi;
+	if (!meminfo_read(&mi) || !mi.mem_free)
 		fprintf(stderr, "/proc/meminfo error\n"), exit(1);
-	if (!swap_total || !swap_free)
+	if (!mi.swap_total || !mi.swap_free)
 		fprintf(stderr, "not enough swap\n"), exit(1);
-	unsigned long size = (swap_free * 3 / 4 + mem_free) * 1024;
-	printf("Will allocate %lu MiB in order to swap\n", size / 1024);
+	unsigned long size = (mi.swap_free * 3 / 4 + mi.mem_free) * 1024;
+	if (cgroup_max) {
+		/* twice memory.max keeps reclaim busy inside the cgroup */
+		size = cgroup_max * 2;
+		if (mi.swap_free * 1024 < size - cgroup_max)
+			fprintf(stderr, "not enough swap\n"), exit(1);
+	}
+	printf("Will allocate %lu MiB in order to swap\n", size / 1024 / 1024);
+
+	delay_calibrate();
 
 	pthread_t pageout;
-	if (pthread_create(&pageout, NULL, background_pageout, mem))
+	if (pthread_create(&pageout, NULL, background_pageout, &engine))
 		perror("pthread_create pageout"), exit(1);
 
 	pthread_t swap;
 	if (pthread_create(&swap, NULL, background_swap, (void *)size))
 		perror("pthread_create swap"), exit(1);
 
+	static struct page_sampler sampler;
+	if (sample_slots) {
+		sampler_init(&sampler, &race, sample_slots);
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, background_sampler, &sampler))
+			perror("pthread_create sampler"), exit(1);
+	}
+
 	pthread_t thread;
-	if (pthread_create(&thread, NULL, writer, mem))
+	if (pthread_create(&thread, NULL, writer, &race))
 		perror("pthread_create writer"), exit(1);
 
+	if (placement) {
+		topo_init();
+		place("main", pthread_self(), thread, pageout);
+	}
+
+	ssize_t read_size = race.nr * HARDBLKSIZE;
 	bool skip_memset = true;
 	while (1) {
-		if (pread(fd, mem, HARDBLKSIZE, 0) != HARDBLKSIZE)
+		__atomic_fetch_add(&race.pin_seq, 1, __ATOMIC_RELEASE);
+		if (preadv(fd, read_iov, race.nr, 0) != read_size)
 			perror("read"), exit(1);
-		if (memcmp(mem, mem+PAGE_SIZE, HARDBLKSIZE)) {
-			if (memcmp(mem, mem+PAGE_SIZE*2, PAGE_SIZE)) {
-				if (skip_memset)
-					printf("unexpected memory "
-					       "corruption detected\n");
-				else
-					printf("memory corruption detected, "
-					       "dumping page\n");
-				int end = PAGE_SIZE;
-				if (!memcmp(mem+HARDBLKSIZE, mem+PAGE_SIZE,
-					    PAGE_SIZE-HARDBLKSIZE))
-					end = HARDBLKSIZE;
-				for (int i = 0; i < end; i++)
-					printf("%x", mem[i]);
-				printf("\n");
-			} else
-				printf("memory corruption detected\n");
-		}
+		bool detected = false;
+		for (unsigned long i = 0; i < race.nr; i++)
+			detected |= check_page(race_page(&race, i), skip_memset);
+		if (detected && sample_slots)
+			sampler_dump(&sampler, race.pin_seq);
 		skip_memset = !skip_memset;
 		if (!skip_memset)
-			memset(mem, 0xff, HARDBLKSIZE);
+			for (unsigned long i = 0; i < race.nr; i++)
+				memset(race_page(&race, i), 0xff, HARDBLKSIZE);
 	}
 
 	return 0;
@@ -0,0 +1,279 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *  Copyright (C) 2021  Red Hat, Inc.
+ *
+ * Loader for page_count_do_wp_page.bpf.c, the indexed libbpf CO-RE
+ * version of page_count_do_wp_page.bp. It reports the same
+ * "COW_after_unprotect" events: every one of them means an
+ * outstanding FOLL_LONGTERM pin on such virtual range may have
+ * silently lost mm coherency.
+ *
+ * The detections arrive as structured records through a BPF ring
+ * buffer, drained in batches at least every 100 ms. They are
+ * deduplicated by tid, comm, pinned range and kind: the first one of
+ * every such key is printed as soon as it is seen, later ones only
+ * update the aggregate. Every --interval seconds (default 1) a rolling
+ * report prints the probe counters summed over all CPUs and every key
+ * that got new detections in the interval, with the number of new and
+ * total events, how many of them hit a different page than the
+ * previous one and the age of the last one.
+ *
+ * The vfio probes replace the bpftrace one-liner of vfio_swap.c; they
+ * are left out when vfio_iommu_type1 is not loaded or wp_page_copy
+ * got inlined.
+ *
+ * The detection is a best effort and may give false positives,
+ * further code analysis is required to be sure.
+ *
+ * To build:
+ *	dnf install clang bpftool libbpf-devel
+ *	bpftool btf dump file /sys/kernel/btf/vmlinux format c > vmlinux.h
+ *	clang -O2 -g -target bpf -D__TARGET_ARCH_x86 \
+ *		-c page_count_do_wp_page.bpf.c -o page_count_do_wp_page.bpf.o
+ *	bpftool gen skeleton page_count_do_wp_page.bpf.o \
+ *		name page_count_do_wp_page > page_count_do_wp_page.skel.h
+ *	gcc -O2 -o page_count_do_wp_page-tracer \
+ *		page_count_do_wp_page-tracer.c -lbpf
+ *	./page_count_do_wp_page-tracer [--interval=SEC]
+ *
+ * Fixed in https://gitlab.com/aarcange/aa/-/tree/mapcount_unshare
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <linux/types.h>
+#include <bpf/libbpf.h>
+#include <bpf/bpf.h>
+#include "page_count_do_wp_page-tracer.h"
+#include "page_count_do_wp_page.skel.h"
+
+static const char *stat_names[NR_STATS] = {
+	[STAT_UNPROTECT] = "unprotect",
+	[STAT_WRPROTECT] = "wrprotect",
+	[STAT_COW] = "cow",
+	[STAT_COW_AFTER_UNPROTECT] = "cow_after_unprotect",
+	[STAT_COW_AFTER_VFIO_PIN] = "cow_after_vfio_pin",
+	[STAT_EVENTS_DROPPED] = "dropped",
+	[STAT_RANGE_TRUNCATED] = "range_truncated",
+	[STAT_FORK] = "fork",
+};
+
+static volatile sig_atomic_t exiting;
+static unsigned long nr_events;
+
+static void sig_handler(int sig)
+{
+	exiting = 1;
+}
+
+static void print_stats(int fd, int nr_cpus)
+{
+	__u64 *values = calloc(nr_cpus, sizeof(*values));
+	if (!values)
+		perror("calloc"), exit(1);
+
+	for (__u32 id = 0; id < NR_STATS; id++) {
+		__u64 sum = 0;
+		if (bpf_map_lookup_elem(fd, &id, values))
+			perror("bpf_map_lookup_elem stats"), exit(1);
+		for (int cpu = 0; cpu < nr_cpus; cpu++)
+			sum += values[cpu];
+		printf("%s%s=%llu", id ? " " : "", stat_names[id],
+		       (unsigned long long) sum);
+	}
+	printf(" events=%lu\n", nr_events);
+	free(values);
+}
+
+#define AGG_BITS 12
+#define AGG_SIZE (1UL << AGG_BITS)
+
+struct aggregate {
+	bool used;
+	struct cow_event first;
+	__u64 last_ts, last_addr;
+	unsigned long count, pages, reported;
+};
+
+static struct aggregate agg[AGG_SIZE];
+static unsigned long nr_agg_overflow;
+
+static const char *event_kind(__u32 flags)
+{
+	return flags & EVENT_VFIO ? "COW_after_vfio_pin" :
+		"COW_after_unprotect";
+}
+
+static bool same_key(const struct cow_event *a, const struct cow_event *b)
+{
+	return a->tid == b->tid && a->flags == b->flags &&
+		a->start == b->start && a->end == b->end &&
+		!strncmp(a->comm, b->comm, TASK_COMM_LEN);
+}
+
+static struct aggregate *agg_lookup(const struct cow_event *event)
+{
+	__u64 hash = (event->start ^ event->end ^
+		      ((__u64) event->tid << 32 | event->flags)) *
+		0x9e3779b97f4a7c15ULL;
+	for (unsigned long i = 0; i < AGG_SIZE; i++) {
+		struct aggregate *a = &agg[((hash >> (64 - AGG_BITS)) + i) &
+					   (AGG_SIZE - 1)];
+		if (!a->used || same_key(&a->first, event))
+			return a;
+	}
+	return NULL;
+}
+
+static int handle_event(void *ctx, void *data, size_t size)
+{
+	const struct cow_event *event = data;
+	if (size < sizeof(*event))
+		return 0;
+	nr_events++;
+
+	struct aggregate *a = agg_lookup(event);
+	if (!a) {
+		nr_agg_overflow++;
+		return 0;
+	}
+	if (!a->used) {
+		a->used = true;
+		a->first = *event;
+		printf("%s addr=0x%llx tid=%u comm=%.*s range=0x%llx-0x%llx\n",
+		       event_kind(event->flags),
+		       (unsigned long long) event->addr, event->tid,
+		       TASK_COMM_LEN, event->comm,
+		       (unsigned long long) event->start,
+		       (unsigned long long) event->end);
+	}
+	if (!a->count || a->last_addr != event->addr)
+		a->pages++;
+	a->count++;
+	a->last_ts = event->ts;
+	a->last_addr = event->addr;
+	return 0;
+}
+
+static __u64 now_ns(void)
+{
+	/* same clock as bpf_ktime_get_ns */
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void report(void)
+{
+	__u64 now = now_ns();
+	for (unsigned long i = 0; i < AGG_SIZE; i++) {
+		struct aggregate *a = &agg[i];
+		if (!a->used || a->count == a->reported)
+			continue;
+		printf("  %s tid=%u comm=%.*s range=0x%llx-0x%llx new=%lu "
+		       "total=%lu pages=%lu last=0x%llx age=%.3fs\n",
+		       event_kind(a->first.flags), a->first.tid,
+		       TASK_COMM_LEN, a->first.comm,
+		       (unsigned long long) a->first.start,
+		       (unsigned long long) a->first.end,
+		       a->count - a->reported, a->count, a->pages,
+		       (unsigned long long) a->last_addr,
+		       (now - a->last_ts) / 1e9);
+		a->reported = a->count;
+	}
+}
+
+static bool kernel_has_symbol(const char *name)
+{
+	FILE *file = fopen("/proc/kallsyms", "r");
+	if (!file)
+		return false;
+
+	char sym[256];
+	bool found = false;
+	while (!found && fscanf(file, "%*s %*s %255s%*[^\n]", sym) == 1)
+		found = !strcmp(sym, name);
+	fclose(file);
+	return found;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long interval = 1;
+	for (int i = 1; i < argc; i++) {
+		if (!strncmp(argv[i], "--interval=", 11) &&
+		    (interval = strtoul(argv[i] + 11, NULL, 0)))
+			continue;
+		printf("%s [--interval=SEC]\n", argv[0]), exit(1);
+	}
+
+	struct page_count_do_wp_page *skel;
+	skel = page_count_do_wp_page__open();
+	if (!skel)
+		fprintf(stderr, "failed to open the BPF program\n"), exit(1);
+	if (!kernel_has_symbol("vfio_pin_pages_remote") ||
+	    !kernel_has_symbol("wp_page_copy")) {
+		fprintf(stderr, "vfio probes disabled\n");
+		bpf_program__set_autoload(skel->progs.vfio_pin_pages_remote,
+					  false);
+		bpf_program__set_autoload(skel->progs.vfio_pin_pages_remote_ret,
+					  false);
+		bpf_program__set_autoload(skel->progs.wp_page_copy, false);
+		bpf_program__set_autoload(skel->progs.vfio_unmap_unpin, false);
+	}
+	if (page_count_do_wp_page__load(skel))
+		fprintf(stderr, "failed to load the BPF program\n"), exit(1);
+	if (page_count_do_wp_page__attach(skel))
+		fprintf(stderr, "failed to attach the BPF program\n"), exit(1);
+
+	int nr_cpus = libbpf_num_possible_cpus();
+	if (nr_cpus < 0)
+		fprintf(stderr, "libbpf_num_possible_cpus failed\n"), exit(1);
+	int stats_fd = bpf_map__fd(skel->maps.stats);
+	struct ring_buffer *events;
+	events = ring_buffer__new(bpf_map__fd(skel->maps.events),
+				  handle_event, NULL, NULL);
+	if (!events)
+		perror("ring_buffer__new"), exit(1);
+
+	signal(SIGINT, sig_handler);
+	signal(SIGTERM, sig_handler);
+	printf("tracing COW_after_unprotect, Ctrl-C to end\n");
+	fflush(stdout);
+	__u64 next_report = now_ns() + interval * 1000000000ULL;
+	while (!exiting) {
+		/*
+		 * The BPF side wakes us only for bursts, epoll never sees
+		 * the records submitted without a wakeup: drain them at
+		 * every timeout.
+		 */
+		int ret = ring_buffer__poll(events, 100);
+		if (!ret)
+			ret = ring_buffer__consume(events);
+		if (ret < 0 && ret != -EINTR)
+			fprintf(stderr, "ring_buffer__poll: %d\n", ret), exit(1);
+		fflush(stdout);
+		if (now_ns() < next_report)
+			continue;
+		next_report += interval * 1000000000ULL;
+		print_stats(stats_fd, nr_cpus);
+		report();
+		if (nr_agg_overflow)
+			printf("  %lu events over %lu keys not aggregated\n",
+			       nr_agg_overflow, AGG_SIZE);
+		fflush(stdout);
+	}
+
+	ring_buffer__consume(events);
+	report();
+	ring_buffer__free(events);
+	page_count_do_wp_page__destroy(skel);
+	return 0;
+}
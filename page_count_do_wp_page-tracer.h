@@ -0,0 +1,68 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ *  Copyright (C) 2021  Red Hat, Inc.
+ *
+ * Map layout shared by page_count_do_wp_page.bpf.c and its loader
+ * page_count_do_wp_page-tracer.c.
+ */
+
+#ifndef PAGE_COUNT_DO_WP_PAGE_TRACER_H
+#define PAGE_COUNT_DO_WP_PAGE_TRACER_H
+
+/*
+ * The unprotected ranges are indexed by mm and by 2 MiB bucket of the
+ * virtual address, so a fault looks up a single bucket. Every bucket
+ * tracks up to RANGE_SLOTS ranges overlapping it and a range is
+ * indexed in at most RANGE_MAX_BUCKETS buckets, larger ranges are
+ * truncated and counted in STAT_RANGE_TRUNCATED.
+ */
+#define RANGE_SHIFT 21
+#define RANGE_SLOTS 4
+#define RANGE_MAX_BUCKETS 64
+
+#define TASK_COMM_LEN 16
+
+struct range_key {
+	__u64 mm;
+	__u64 bucket;
+};
+
+/*
+ * A slot is valid only while its generation matches the one of the
+ * mm, which is bumped by fork() and by exit_mmap(), so both forget
+ * all ranges of the mm in O(1).
+ */
+struct range_slots {
+	__u64 start[RANGE_SLOTS];
+	__u64 end[RANGE_SLOTS];
+	__u64 gen[RANGE_SLOTS];
+};
+
+/* cow_event.flags: which kind of pinned range the COW hit */
+#define EVENT_UNPROTECT	0x1
+#define EVENT_VFIO	0x2
+
+/* record streamed through the "events" ring buffer */
+struct cow_event {
+	__u64 ts;
+	__u64 addr;
+	__u64 start;
+	__u64 end;
+	__u32 tid;
+	__u32 flags;
+	char comm[TASK_COMM_LEN];
+};
+
+enum tracer_stat {
+	STAT_UNPROTECT,
+	STAT_WRPROTECT,
+	STAT_COW,
+	STAT_COW_AFTER_UNPROTECT,
+	STAT_COW_AFTER_VFIO_PIN,
+	STAT_EVENTS_DROPPED,
+	STAT_RANGE_TRUNCATED,
+	STAT_FORK,
+	NR_STATS,
+};
+
+#endif
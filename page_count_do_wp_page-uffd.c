@@ -0,0 +1,344 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ *  deterministic reproducer for v5.11 (still works on v5.15-rc3)
+ *  memory corruption with page_count instead of mapcount in
+ *  do_wp_page, with the O_DIRECT pin held open by userfaultfd.
+ *
+ *  Copyright (C) 2021  Red Hat, Inc.
+ *
+ *  gcc -O2 -o page_count_do_wp_page-uffd page_count_do_wp_page-uffd.c -lpthread
+ *  ./page_count_do_wp_page-uffd [--uffd=missing|wp] \
+ *	[--perturb=clear_refs|mprotect|pageout] [--iterations=N] \
+ *	./whateverfile
+ *
+ *  Every iteration does one O_DIRECT preadv() of two 512 byte blocks:
+ *  the first lands in the race page, the second in a neighbour page
+ *  registered with userfaultfd, missing (the default, the neighbour is
+ *  zapped before every read) or write-protect. The direct I/O pins the
+ *  race page first and then faults on the neighbour, so the read
+ *  stalls in the userfaultfd with the race page pinned. The fault
+ *  handler then injects the --perturb event on the race page
+ *  (clear_refs by default), writes to it and only then resolves the
+ *  fault and lets the read complete. A kernel that COWs the pinned
+ *  page lets the read land in the old copy, so the corruption shows
+ *  up in the first iteration instead of after minutes of random
+ *  delays.
+ *
+ *  The process exits with 2 at the first detection and with 0 after
+ *  --iterations (default 100) clean reads, which makes it usable as a
+ *  per-commit gate. It warns if the read did not stall, which means
+ *  the window was not held open and the result proves nothing.
+ *
+ *  The fault comes from GUP in kernel mode, so userfaultfd must not be
+ *  restricted to user mode faults: it needs root,
+ *  vm.unprivileged_userfaultfd=1 or access to /dev/userfaultfd.
+ *  --uffd=wp requires v5.7, clear_refs CONFIG_SOFT_DIRTY=y.
+ *
+ *  This is caused by the VM design flaw introduced in commit
+ *  09854ba94c6aad7886996bfbee2530b3d8a7f4f4.
+ *
+ *  Fixed in https://gitlab.com/aarcange/aa/-/tree/mapcount_unshare
+ */
+
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <linux/userfaultfd.h>
+
+#define PAGE_SIZE (1UL<<12)
+/*
+ * NOTE: an arch with a PAGE_SIZE > 4k will reproduce the silent mm
+ * corruption with an HARDBLKSIZE of 4k or more.
+ */
+#define HARDBLKSIZE 512
+
+#ifndef USERFAULTFD_IOC_NEW
+#define USERFAULTFD_IOC_NEW _IO(0xAA, 0x00)
+#endif
+
+enum perturb {
+	PERTURB_CLEAR_REFS,
+	PERTURB_MPROTECT,
+	PERTURB_PAGEOUT,
+};
+
+static const char *perturb_names[] = {
+	[PERTURB_CLEAR_REFS] = "clear_refs",
+	[PERTURB_MPROTECT] = "mprotect",
+	[PERTURB_PAGEOUT] = "pageout",
+};
+
+struct uffd_race {
+	int uffd;
+	bool wp;
+	enum perturb perturb;
+	int clear_refs_fd;
+	/* race page, its expected content and its content before the read */
+	char *mem;
+	char *neighbour;
+	/* source of UFFDIO_COPY in missing mode */
+	char *zero;
+	/* faults handled, bumped after the fault is resolved */
+	unsigned long faults;
+};
+
+static int uffd_open(void)
+{
+	int uffd = syscall(__NR_userfaultfd, O_CLOEXEC);
+	if (uffd >= 0)
+		return uffd;
+	/* v6.1 allows it to the users with access to /dev/userfaultfd */
+	int dev = open("/dev/userfaultfd", O_RDWR|O_CLOEXEC);
+	if (dev < 0)
+		return -1;
+	uffd = ioctl(dev, USERFAULTFD_IOC_NEW, O_CLOEXEC);
+	close(dev);
+	return uffd;
+}
+
+static void uffd_setup(struct uffd_race *race)
+{
+	race->uffd = uffd_open();
+	if (race->uffd < 0)
+		perror("userfaultfd"), exit(1);
+
+	struct uffdio_api api = {
+		.api = UFFD_API,
+		.features = race->wp ? UFFD_FEATURE_PAGEFAULT_FLAG_WP : 0,
+	};
+	if (ioctl(race->uffd, UFFDIO_API, &api))
+		perror("UFFDIO_API"), exit(1);
+
+	struct uffdio_register reg = {
+		.range = {
+			.start = (unsigned long) race->neighbour,
+			.len = PAGE_SIZE,
+		},
+		.mode = race->wp ? UFFDIO_REGISTER_MODE_WP :
+			UFFDIO_REGISTER_MODE_MISSING,
+	};
+	if (ioctl(race->uffd, UFFDIO_REGISTER, &reg))
+		perror("UFFDIO_REGISTER"), exit(1);
+}
+
+/* arm the neighbour so the next GUP on it stalls in the handler */
+static void uffd_arm(struct uffd_race *race)
+{
+	if (!race->wp) {
+		if (madvise(race->neighbour, PAGE_SIZE, MADV_DONTNEED))
+			perror("madvise DONTNEED"), exit(1);
+		return;
+	}
+	struct uffdio_writeprotect wp = {
+		.range = {
+			.start = (unsigned long) race->neighbour,
+			.len = PAGE_SIZE,
+		},
+		.mode = UFFDIO_WRITEPROTECT_MODE_WP,
+	};
+	if (ioctl(race->uffd, UFFDIO_WRITEPROTECT, &wp))
+		perror("UFFDIO_WRITEPROTECT"), exit(1);
+}
+
+static void uffd_resolve(struct uffd_race *race)
+{
+	if (!race->wp) {
+		struct uffdio_copy copy = {
+			.dst = (unsigned long) race->neighbour,
+			.src = (unsigned long) race->zero,
+			.len = PAGE_SIZE,
+		};
+		if (ioctl(race->uffd, UFFDIO_COPY, &copy))
+			perror("UFFDIO_COPY"), exit(1);
+		return;
+	}
+	struct uffdio_writeprotect wp = {
+		.range = {
+			.start = (unsigned long) race->neighbour,
+			.len = PAGE_SIZE,
+		},
+	};
+	if (ioctl(race->uffd, UFFDIO_WRITEPROTECT, &wp))
+		perror("UFFDIO_WRITEPROTECT"), exit(1);
+}
+
+/* runs while the read is stalled with the race page pinned */
+static void perturb(struct uffd_race *race)
+{
+	volatile char *mem = race->mem;
+
+	switch (race->perturb) {
+	case PERTURB_CLEAR_REFS:
+		if (write(race->clear_refs_fd, "4", 1) != 1)
+			perror("write soft dirty"), exit(1);
+		break;
+	case PERTURB_MPROTECT:
+		if (mprotect(race->mem, PAGE_SIZE, PROT_READ) ||
+		    mprotect(race->mem, PAGE_SIZE, PROT_READ|PROT_WRITE))
+			perror("mprotect"), exit(1);
+		break;
+	case PERTURB_PAGEOUT:
+		if (madvise(race->mem, PAGE_SIZE, MADV_PAGEOUT))
+			perror("madvise PAGEOUT"), exit(1);
+		break;
+	}
+
+	/* the write fault that must not COW the pinned page */
+	char x = mem[PAGE_SIZE-1];
+	mem[PAGE_SIZE-1] = x;
+}
+
+static void* fault_handler(void *_race)
+{
+	struct uffd_race *race = _race;
+	for (;;) {
+		struct uffd_msg msg;
+		ssize_t ret = read(race->uffd, &msg, sizeof(msg));
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret != sizeof(msg))
+			perror("read userfaultfd"), exit(1);
+		if (msg.event != UFFD_EVENT_PAGEFAULT)
+			continue;
+
+		perturb(race);
+		uffd_resolve(race);
+		__atomic_fetch_add(&race->faults, 1, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+static bool check_page(char *mem, unsigned long iteration)
+{
+	if (!memcmp(mem, mem+PAGE_SIZE, HARDBLKSIZE))
+		return false;
+	if (memcmp(mem, mem+PAGE_SIZE*2, HARDBLKSIZE)) {
+		printf("unexpected memory corruption detected at iteration "
+		       "%lu, dumping page\n", iteration);
+		for (unsigned int i = 0; i < HARDBLKSIZE; i++)
+			printf("%x", mem[i]);
+		printf("\n");
+	} else
+		printf("memory corruption detected at iteration %lu\n",
+		       iteration);
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	char *filename = NULL;
+	struct uffd_race race = { .perturb = PERTURB_CLEAR_REFS };
+	unsigned long iterations = 100;
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--uffd=missing"))
+			race.wp = false;
+		else if (!strcmp(argv[i], "--uffd=wp"))
+			race.wp = true;
+		else if (!strncmp(argv[i], "--perturb=", 10)) {
+			unsigned int p;
+			for (p = 0; p < sizeof(perturb_names) /
+				     sizeof(perturb_names[0]); p++)
+				if (!strcmp(argv[i] + 10, perturb_names[p]))
+					break;
+			if (p == sizeof(perturb_names) /
+			    sizeof(perturb_names[0]))
+				printf("invalid perturb\n"), exit(1);
+			race.perturb = p;
+		} else if (!strncmp(argv[i], "--iterations=", 13)) {
+			iterations = strtoul(argv[i] + 13, NULL, 0);
+			if (!iterations)
+				printf("invalid iterations\n"), exit(1);
+		} else if (!filename)
+			filename = argv[i];
+		else {
+			filename = NULL;
+			break;
+		}
+	}
+	if (!filename)
+		printf("%s [--uffd=missing|wp] "
+		       "[--perturb=clear_refs|mprotect|pageout] "
+		       "[--iterations=N] <filename>\n", argv[0]), exit(1);
+
+	char *mem;
+	if (posix_memalign((void **)&mem, PAGE_SIZE, PAGE_SIZE*3))
+		perror("posix_memalign"), exit(1);
+	/* THP is not using page_count so it would not corrupt memory */
+	if (madvise(mem, PAGE_SIZE*3, MADV_NOHUGEPAGE))
+		perror("madvise"), exit(1);
+	bzero(mem, PAGE_SIZE*3);
+	memset(mem + PAGE_SIZE*2, 0xff, HARDBLKSIZE);
+	race.mem = mem;
+
+	/* its own vma, so registering it leaves the race page alone */
+	race.neighbour = mmap(NULL, PAGE_SIZE, PROT_READ|PROT_WRITE,
+			      MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (race.neighbour == MAP_FAILED)
+		perror("mmap"), exit(1);
+	/* uffd-wp protects only present ptes */
+	memset(race.neighbour, 0, PAGE_SIZE);
+	if (posix_memalign((void **)&race.zero, PAGE_SIZE, PAGE_SIZE))
+		perror("posix_memalign"), exit(1);
+	bzero(race.zero, PAGE_SIZE);
+
+	race.clear_refs_fd = open("/proc/self/clear_refs", O_WRONLY);
+	if (race.clear_refs_fd < 0 && race.perturb == PERTURB_CLEAR_REFS)
+		perror("open clear_refs"), exit(1);
+
+	uffd_setup(&race);
+
+	int fd = open(filename, O_DIRECT|O_CREAT|O_RDWR|O_TRUNC, 0600);
+	if (fd < 0)
+		perror("open"), exit(1);
+	/* two zero blocks, read back by every preadv */
+	if (write(fd, mem + PAGE_SIZE, PAGE_SIZE) != PAGE_SIZE)
+		perror("write"), exit(1);
+
+	pthread_t handler;
+	if (pthread_create(&handler, NULL, fault_handler, &race))
+		perror("pthread_create handler"), exit(1);
+
+	printf("uffd=%s perturb=%s iterations=%lu\n",
+	       race.wp ? "wp" : "missing", perturb_names[race.perturb],
+	       iterations);
+	fflush(stdout);
+
+	struct iovec iov[2] = {
+		{ .iov_base = mem, .iov_len = HARDBLKSIZE },
+		{ .iov_base = race.neighbour, .iov_len = HARDBLKSIZE },
+	};
+	unsigned long stalls = 0;
+	for (unsigned long i = 0; i < iterations; i++) {
+		/* the pre-read content stays visible if the read is lost */
+		memset(mem, 0xff, HARDBLKSIZE);
+		uffd_arm(&race);
+
+		unsigned long faults = __atomic_load_n(&race.faults,
+						       __ATOMIC_ACQUIRE);
+		if (preadv(fd, iov, 2, 0) != HARDBLKSIZE*2)
+			perror("read"), exit(1);
+		if (__atomic_load_n(&race.faults, __ATOMIC_ACQUIRE) != faults)
+			stalls++;
+
+		if (check_page(mem, i)) {
+			fflush(stdout);
+			exit(2);
+		}
+	}
+	if (stalls != iterations)
+		printf("WARNING: only %lu of %lu reads stalled with the page "
+		       "pinned\n", stalls, iterations);
+	printf("no corruption in %lu iterations\n", iterations);
+	return 0;
+}
@@ -0,0 +1,354 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *  Copyright (C) 2021  Red Hat, Inc.
+ *
+ * libbpf CO-RE version of page_count_do_wp_page.bp, cheap enough to
+ * be left enabled on production hosts. It detects the same
+ * "COW_after_unprotect" events: copy-on-write faults on pages with
+ * mapcount == 1 inside MAP_ANONYMOUS MAP_PRIVATE ranges that an
+ * mprotect() transitioned from wrprotected to writable and non
+ * executable.
+ *
+ * Instead of scanning 2000 entries per probe, the ranges are kept per
+ * mm in a hash indexed by 2 MiB bucket (see
+ * page_count_do_wp_page-tracer.h), so do_wp_page and unlock_page do a
+ * single lookup, fork() invalidates all ranges of the mm by bumping
+ * its generation and mprotect() touches at most RANGE_MAX_BUCKETS
+ * buckets. The statistics live in a per-CPU array.
+ *
+ * It also replaces the bpftrace one-liner of vfio_swap.c: COW faults
+ * through wp_page_copy inside the range last pinned by
+ * vfio_pin_pages_remote in the same thread.
+ *
+ * Every detection is streamed as a struct cow_event through a ring
+ * buffer. Consumers are woken only once EVENTS_WAKEUP records are
+ * pending, the loader polls with a timeout for the rest, so a burst
+ * costs no per-event wakeup. Records that do not fit are counted in
+ * STAT_EVENTS_DROPPED.
+ *
+ * The kprobe arguments follow the v5.11 prototypes of mprotect_fixup,
+ * do_wp_page, unlock_page, copy_process, wp_page_copy and
+ * vfio_pin_pages_remote.
+ *
+ * To build and run, see page_count_do_wp_page-tracer.c.
+ *
+ * Fixed in https://gitlab.com/aarcange/aa/-/tree/mapcount_unshare
+ */
+
+#include "vmlinux.h"
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_tracing.h>
+#include <bpf/bpf_core_read.h>
+#include "page_count_do_wp_page-tracer.h"
+
+#define VM_WRITE	0x00000002
+#define VM_EXEC		0x00000004
+#define VM_SHARED	0x00000008
+#define CLONE_VM	0x00000100
+
+char LICENSE[] SEC("license") = "GPL";
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(max_entries, 65536);
+	__type(key, struct range_key);
+	__type(value, struct range_slots);
+} ranges SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(max_entries, 16384);
+	__type(key, __u64);
+	__type(value, __u64);
+} mm_gen SEC(".maps");
+
+struct wp_fault {
+	__u64 mm;
+	__u64 addr;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(max_entries, 16384);
+	__type(key, __u32);
+	__type(value, struct wp_fault);
+} wp SEC(".maps");
+
+struct vfio_pin {
+	__u64 start;
+	__u64 nr_pages;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(max_entries, 16384);
+	__type(key, __u32);
+	__type(value, struct vfio_pin);
+} vfio_pins SEC(".maps");
+
+#define EVENTS_WAKEUP 64
+
+struct {
+	__uint(type, BPF_MAP_TYPE_RINGBUF);
+	__uint(max_entries, 256 * 1024);
+} events SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, NR_STATS);
+	__type(key, __u32);
+	__type(value, __u64);
+} stats SEC(".maps");
+
+static __always_inline void stat_inc(__u32 id)
+{
+	__u64 *count = bpf_map_lookup_elem(&stats, &id);
+	if (count)
+		(*count)++;
+}
+
+static __always_inline void emit_event(__u32 tid, __u64 addr, __u64 start,
+				       __u64 end, __u32 flags)
+{
+	struct cow_event *event;
+	event = bpf_ringbuf_reserve(&events, sizeof(*event), 0);
+	if (!event) {
+		stat_inc(STAT_EVENTS_DROPPED);
+		return;
+	}
+	event->ts = bpf_ktime_get_ns();
+	event->addr = addr;
+	event->start = start;
+	event->end = end;
+	event->tid = tid;
+	event->flags = flags;
+	bpf_get_current_comm(&event->comm, sizeof(event->comm));
+
+	__u64 pending = bpf_ringbuf_query(&events, BPF_RB_AVAIL_DATA);
+	bpf_ringbuf_submit(event, pending >= EVENTS_WAKEUP * sizeof(*event) ?
+			   BPF_RB_FORCE_WAKEUP : BPF_RB_NO_WAKEUP);
+}
+
+static __always_inline __u64 mm_generation(__u64 mm)
+{
+	__u64 *gen = bpf_map_lookup_elem(&mm_gen, &mm);
+	return gen ? *gen : 0;
+}
+
+static __always_inline void mm_generation_bump(__u64 mm)
+{
+	__u64 *gen = bpf_map_lookup_elem(&mm_gen, &mm);
+	if (gen) {
+		__sync_fetch_and_add(gen, 1);
+	} else {
+		__u64 one = 1;
+		bpf_map_update_elem(&mm_gen, &mm, &one, BPF_NOEXIST);
+	}
+}
+
+static __always_inline bool anon_private(struct vm_area_struct *vma)
+{
+	return !BPF_CORE_READ(vma, vm_ops) && BPF_CORE_READ(vma, anon_vma) &&
+		!BPF_CORE_READ(vma, vm_file);
+}
+
+static __always_inline void range_insert(struct range_key *key,
+					 struct range_slots *slots,
+					 __u64 start, __u64 end, __u64 gen)
+{
+	if (!slots) {
+		struct range_slots new = {};
+		new.start[0] = start;
+		new.end[0] = end;
+		new.gen[0] = gen;
+		bpf_map_update_elem(&ranges, key, &new, BPF_NOEXIST);
+		return;
+	}
+
+	/* reuse a free or stale slot, or evict one */
+	int victim = (start >> 12) % RANGE_SLOTS;
+	for (int i = RANGE_SLOTS - 1; i >= 0; i--) {
+		if (slots->gen[i] == gen && slots->start[i] == start &&
+		    slots->end[i] == end)
+			return;
+		if (!slots->end[i] || slots->gen[i] != gen)
+			victim = i;
+	}
+	slots->start[victim & (RANGE_SLOTS - 1)] = start;
+	slots->end[victim & (RANGE_SLOTS - 1)] = end;
+	slots->gen[victim & (RANGE_SLOTS - 1)] = gen;
+}
+
+static __always_inline void range_remove(struct range_slots *slots,
+					 __u64 start, __u64 end)
+{
+	for (int i = 0; i < RANGE_SLOTS; i++)
+		if (slots->start[i] < end && slots->end[i] > start)
+			slots->end[i] = 0;
+}
+
+SEC("kprobe/mprotect_fixup")
+int BPF_KPROBE(mprotect_fixup, struct vm_area_struct *vma, void *pprev,
+	       unsigned long start, unsigned long end, unsigned long newflags)
+{
+	if (!anon_private(vma))
+		return 0;
+
+	__u64 oldflags = BPF_CORE_READ(vma, vm_flags);
+	bool unprotect = !(oldflags & VM_WRITE) && (newflags & VM_WRITE) &&
+		!(newflags & VM_EXEC);
+	/* only unprotect and wrprotect transitions change the ranges */
+	if (!unprotect && (newflags & VM_WRITE))
+		return 0;
+	stat_inc(unprotect ? STAT_UNPROTECT : STAT_WRPROTECT);
+
+	struct range_key key = {
+		.mm = (__u64) BPF_CORE_READ(vma, vm_mm),
+	};
+	__u64 gen = mm_generation(key.mm);
+	__u64 first = start >> RANGE_SHIFT, last = (end - 1) >> RANGE_SHIFT;
+	if (last - first >= RANGE_MAX_BUCKETS) {
+		stat_inc(STAT_RANGE_TRUNCATED);
+		last = first + RANGE_MAX_BUCKETS - 1;
+	}
+
+	for (int i = 0; i < RANGE_MAX_BUCKETS; i++) {
+		key.bucket = first + i;
+		if (key.bucket > last)
+			break;
+		struct range_slots *slots = bpf_map_lookup_elem(&ranges, &key);
+		if (unprotect)
+			range_insert(&key, slots, start, end, gen);
+		else if (slots)
+			range_remove(slots, start, end);
+	}
+	return 0;
+}
+
+SEC("kprobe/do_wp_page")
+int BPF_KPROBE(do_wp_page, struct vm_fault *vmf)
+{
+	struct vm_area_struct *vma = BPF_CORE_READ(vmf, vma);
+	if (BPF_CORE_READ(vma, vm_flags) & VM_SHARED || !anon_private(vma))
+		return 0;
+
+	__u32 tid = (__u32) bpf_get_current_pid_tgid();
+	struct wp_fault fault = {
+		.mm = (__u64) BPF_CORE_READ(vma, vm_mm),
+		.addr = BPF_CORE_READ(vmf, address),
+	};
+	bpf_map_update_elem(&wp, &tid, &fault, BPF_ANY);
+	return 0;
+}
+
+SEC("kretprobe/do_wp_page")
+int BPF_KRETPROBE(do_wp_page_ret)
+{
+	__u32 tid = (__u32) bpf_get_current_pid_tgid();
+	bpf_map_delete_elem(&wp, &tid);
+	return 0;
+}
+
+SEC("kprobe/unlock_page")
+int BPF_KPROBE(unlock_page, struct page *page)
+{
+	__u32 tid = (__u32) bpf_get_current_pid_tgid();
+	struct wp_fault *fault = bpf_map_lookup_elem(&wp, &tid);
+	if (!fault)
+		return 0;
+	if (BPF_CORE_READ(page, _mapcount.counter) != 0)
+		return 0;
+
+	__u64 addr = fault->addr;
+	struct range_key key = {
+		.mm = fault->mm,
+		.bucket = addr >> RANGE_SHIFT,
+	};
+	bpf_map_delete_elem(&wp, &tid);
+	stat_inc(STAT_COW);
+
+	struct range_slots *slots = bpf_map_lookup_elem(&ranges, &key);
+	if (!slots)
+		return 0;
+	__u64 gen = mm_generation(key.mm);
+	for (int i = 0; i < RANGE_SLOTS; i++) {
+		if (slots->gen[i] != gen || slots->start[i] > addr ||
+		    addr >= slots->end[i])
+			continue;
+
+		emit_event(tid, addr, slots->start[i], slots->end[i],
+			   EVENT_UNPROTECT);
+		stat_inc(STAT_COW_AFTER_UNPROTECT);
+		break;
+	}
+	return 0;
+}
+
+SEC("kprobe/copy_process")
+int BPF_KPROBE(copy_process, struct pid *pid, int trace, int node,
+	       struct kernel_clone_args *args)
+{
+	/* threads share the mm, fork wrprotects it */
+	if (BPF_CORE_READ(args, flags) & CLONE_VM)
+		return 0;
+	struct task_struct *task = (struct task_struct *) bpf_get_current_task();
+	mm_generation_bump((__u64) BPF_CORE_READ(task, mm));
+	stat_inc(STAT_FORK);
+	return 0;
+}
+
+SEC("kprobe/exit_mmap")
+int BPF_KPROBE(exit_mmap, struct mm_struct *mm)
+{
+	/* a recycled mm_struct must not inherit stale ranges */
+	mm_generation_bump((__u64) mm);
+	return 0;
+}
+
+SEC("kprobe/vfio_pin_pages_remote")
+int BPF_KPROBE(vfio_pin_pages_remote, void *dma, unsigned long vaddr)
+{
+	__u32 tid = (__u32) bpf_get_current_pid_tgid();
+	struct vfio_pin pin = { .start = vaddr };
+	bpf_map_update_elem(&vfio_pins, &tid, &pin, BPF_ANY);
+	return 0;
+}
+
+SEC("kretprobe/vfio_pin_pages_remote")
+int BPF_KRETPROBE(vfio_pin_pages_remote_ret, long pinned)
+{
+	__u32 tid = (__u32) bpf_get_current_pid_tgid();
+	struct vfio_pin *pin = bpf_map_lookup_elem(&vfio_pins, &tid);
+	if (!pin)
+		return 0;
+	if (pinned <= 0)
+		bpf_map_delete_elem(&vfio_pins, &tid);
+	else
+		pin->nr_pages = pinned;
+	return 0;
+}
+
+SEC("kprobe/wp_page_copy")
+int BPF_KPROBE(wp_page_copy, struct vm_fault *vmf)
+{
+	__u32 tid = (__u32) bpf_get_current_pid_tgid();
+	struct vfio_pin *pin = bpf_map_lookup_elem(&vfio_pins, &tid);
+	if (!pin || !pin->nr_pages)
+		return 0;
+
+	__u64 addr = BPF_CORE_READ(vmf, address);
+	__u64 end = pin->start + (pin->nr_pages << 12);
+	if (addr < pin->start || addr >= end)
+		return 0;
+	emit_event(tid, addr, pin->start, end, EVENT_VFIO);
+	stat_inc(STAT_COW_AFTER_VFIO_PIN);
+	return 0;
+}
+
+SEC("kprobe/vfio_unmap_unpin")
+int BPF_KPROBE(vfio_unmap_unpin)
+{
+	__u32 tid = (__u32) bpf_get_current_pid_tgid();
+	bpf_map_delete_elem(&vfio_pins, &tid);
+	return 0;
+}
@@ -7,7 +7,42 @@
  *  Copyright (C) 2021  Red Hat, Inc.
  *
  *  gcc -O2 -o page_count_do_wp_page page_count_do_wp_page.c -lpthread
- *  ./page_count_do_wp_page ./whateverfile
+ *  ./page_count_do_wp_page [--shards[=N]] [--pages=N] [--phase] [--stamp] \
+ *	[--placement=smt|llc|cross-llc|cross-node] [--ramdisk] ./whateverfile
+ *
+ *  --shards runs N independent page triplets in parallel, each with
+ *  its own O_DIRECT reader, writer and clear_refs thread. Without =N
+ *  one shard is started for every three online CPUs.
+ *
+ *  --pages makes every shard read N page triplets (up to UIO_MAXIOV)
+ *  with a single preadv(), so N pages are pinned at once. The pages
+ *  are checked with a vectorized comparator and each corrupted page
+ *  is reported as a run-length diff against the expected content.
+ *
+ *  --phase makes every writer fault the page at a chosen offset after
+ *  its reader starts the pread() pin, instead of at random times. The
+ *  offsets sweep twice the average read latency in PHASE_BUCKETS
+ *  steps, and the steps that caught corruption are chosen more often.
+ *
+ *  --stamp makes every read a new generation: before each pread() the
+ *  reader stamps a sequence number and a TSC timestamp into the block
+ *  of every page and, with a different fill, into the file block it
+ *  reads back, so every read changes the page. Each shard then reads
+ *  its own region of the file. A detection reports which generation
+ *  the page holds instead of the expected one, whether the stamp came
+ *  from memory or from the file, and how many ns ago it was stamped.
+ *
+ *  --ramdisk reads from a loop device over tmpfs set up on the fly,
+ *  so every pin lasts microseconds instead of the latency of the
+ *  disk. It needs root and falls back to the file given on the
+ *  command line.
+ *
+ *  --placement pins the reader, the writer and the clear_refs thread
+ *  of every shard according to the CPU topology: "smt" puts reader
+ *  and writer on SMT siblings, "llc" on different cores of the same
+ *  LLC, "cross-llc" on different LLCs and "cross-node" on different
+ *  NUMA nodes. The perturber always shares the LLC of the reader. The
+ *  CPUs chosen are printed on a "placement policy=" line.
  *
  *  NOTE: CONFIG_SOFT_DIRTY=y is required in the kernel config.
  *
@@ -34,7 +69,19 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <sched.h>
+#include <dirent.h>
+#include <limits.h>
 #include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "page_count_do_wp_page-common.h"
 
 #define PAGE_SIZE (1UL<<12)
 /*
@@ -43,46 +90,424 @@
  */
 #define HARDBLKSIZE 512
 
-static void* writer(void *_mem)
+static void* background_soft_dirty(void *data)
+{
+	long fd = (long) data;
+	for (;;)
+		if (write(fd, "4", 1) != 1)
+			perror("write soft dirty"), exit(1);
+	return NULL;
+}
+
+/*
+ * Page checker. Every race page is followed by its expected content
+ * and by the content it had before the read. The block compare
+ * accumulates the XOR of both sides without branching, so a clean
+ * page costs one pass over its block and only dirty pages get the full
+ * compare that classifies them.
+ */
+enum page_class {
+	PAGE_CLEAN,
+	/* the read never landed, the page still holds the pre-read data */
+	PAGE_STALE,
+	PAGE_FOREIGN,
+};
+
+#define DIFF_MAX_RUNS 32
+
+static bool block_equal_scalar(const char *a, const char *b, size_t len)
 {
-	char *mem = (char *)_mem;
+	uint64_t acc = 0;
+	for (size_t i = 0; i < len; i += sizeof(uint64_t)) {
+		uint64_t x, y;
+		memcpy(&x, a + i, sizeof(x));
+		memcpy(&y, b + i, sizeof(y));
+		acc |= x ^ y;
+	}
+	return !acc;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static bool block_equal_sse2(const char *a, const char *b, size_t len)
+{
+	__m128i acc = _mm_setzero_si128();
+	for (size_t i = 0; i < len; i += sizeof(__m128i)) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+		__m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+		acc = _mm_or_si128(acc, _mm_xor_si128(x, y));
+	}
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) ==
+		0xffff;
+}
+
+__attribute__((target("avx2")))
+static bool block_equal_avx2(const char *a, const char *b, size_t len)
+{
+	__m256i acc = _mm256_setzero_si256();
+	for (size_t i = 0; i < len; i += sizeof(__m256i)) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+		__m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+		acc = _mm256_or_si256(acc, _mm256_xor_si256(x, y));
+	}
+	return _mm256_testz_si256(acc, acc);
+}
+#endif
+
+/* len must be a multiple of 32 */
+static bool (*block_equal)(const char *, const char *, size_t) =
+	block_equal_scalar;
+
+static void checker_init(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		block_equal = block_equal_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		block_equal = block_equal_sse2;
+#endif
+}
+
+/* classify nr page triplets, returns how many are not clean */
+static unsigned int check_pages(char *mem, unsigned int nr,
+				unsigned char *class)
+{
+	unsigned int dirty = 0;
+	for (unsigned int i = 0; i < nr; i++) {
+		char *page = mem + i * PAGE_SIZE*3;
+		if (block_equal(page, page+PAGE_SIZE, HARDBLKSIZE)) {
+			class[i] = PAGE_CLEAN;
+			continue;
+		}
+		dirty++;
+		if (block_equal(page, page+PAGE_SIZE*2, PAGE_SIZE))
+			class[i] = PAGE_STALE;
+		else
+			class[i] = PAGE_FOREIGN;
+	}
+	return dirty;
+}
+
+/* print the bytes that differ as offset+length:value runs */
+static void print_diff(const char *page, const char *expected)
+{
+	unsigned int runs = 0;
+	for (unsigned int i = 0; i < PAGE_SIZE;) {
+		if (page[i] == expected[i]) {
+			i++;
+			continue;
+		}
+		unsigned int start = i;
+		char value = page[i];
+		while (i < PAGE_SIZE && page[i] != expected[i] &&
+		       page[i] == value)
+			i++;
+		if (runs++ < DIFF_MAX_RUNS)
+			printf(" %u+%u:%02x", start, i - start,
+			       (unsigned char) value);
+	}
+	if (runs > DIFF_MAX_RUNS)
+		printf(" ...");
+	printf(" runs=%u\n", runs);
+}
+
+/*
+ * Generation stamps for --stamp, at the start of the block of every
+ * page. The memory side is filled with 0xff and the file side with
+ * zeroes like the two states of the unstamped loop.
+ */
+#define STAMP_FILE 0x454c4946	/* "FILE" */
+#define STAMP_MEMORY 0x214d454d	/* "MEM!" */
+
+struct stamp {
+	uint64_t seq;
+	uint64_t tsc;
+	uint32_t source;
+	uint32_t page;
+};
+
+static bool stamp;
+static double stamp_ns_per_tick = 1;
+
+static inline uint64_t stamp_clock(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	return now_ns();
+#endif
+}
+
+static void stamp_calibrate(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	unsigned long start = now_ns();
+	uint64_t tsc = stamp_clock();
+	delay_ns(10000000);
+	stamp_ns_per_tick = (double) (now_ns() - start) / (stamp_clock() - tsc);
+#endif
+}
+
+static void stamp_block(char *block, int fill, uint32_t source,
+			unsigned int page, unsigned long seq)
+{
+	struct stamp st = {
+		.seq = seq,
+		.tsc = stamp_clock(),
+		.source = source,
+		.page = page,
+	};
+	memset(block, fill, HARDBLKSIZE);
+	memcpy(block, &st, sizeof(st));
+}
+
+#define PHASE_BUCKETS 32
+#define PHASE_HIT_WEIGHT 64
+
+struct shard {
+	unsigned int id;
+	char *mem;
+	unsigned int nr_pages;
+	struct iovec *iov;
+	int fd;
+	/* file region read by this shard, only non zero with --stamp */
+	off_t offset;
+	char *stamp_buf;
+	unsigned long seq;
+	long soft_dirty_fd;
+	pthread_t reader, writer, soft_dirty;
+	/* phase scheduling, bumped by the reader before every pread */
+	unsigned long pin_seq;
+	unsigned long read_ns;
+	unsigned int last_bucket;
+	unsigned long hits[PHASE_BUCKETS];
+};
+
+static unsigned int nr_shards = 1, nr_pages = 1;
+static bool phase;
+
+static inline char *shard_page(struct shard *shard, unsigned int i)
+{
+	return shard->mem + i * PAGE_SIZE*3;
+}
+
+static void* writer(void *data)
+{
+	struct shard *shard = data;
 	for(;;) {
-		usleep(random() % 1000);
+		random_delay_us(1000);
+		char *mem = shard_page(shard, rng_next() % shard->nr_pages);
 		mem[PAGE_SIZE-1] = 0;
 	}
 	return NULL;
 }
 
-static void* background_soft_dirty(void *data)
+/* pick an offset bucket, the ones that hit the race weigh more */
+static unsigned int phase_pick(struct shard *shard)
 {
-	long fd = (long) data;
-	for (;;)
-		if (write(fd, "4", 1) != 1)
-			perror("write soft dirty"), exit(1);
+	unsigned long weight[PHASE_BUCKETS], total = 0;
+	for (int i = 0; i < PHASE_BUCKETS; i++) {
+		weight[i] = 1 + PHASE_HIT_WEIGHT *
+			__atomic_load_n(&shard->hits[i], __ATOMIC_RELAXED);
+		total += weight[i];
+	}
+	unsigned long r = rng_next() % total;
+	unsigned int i;
+	for (i = 0; r >= weight[i]; i++)
+		r -= weight[i];
+	return i;
+}
+
+static unsigned long phase_offset_ns(struct shard *shard, unsigned int bucket)
+{
+	unsigned long read_ns = __atomic_load_n(&shard->read_ns,
+						__ATOMIC_RELAXED);
+	return bucket * 2 * read_ns / PHASE_BUCKETS;
+}
+
+static void* phase_writer(void *data)
+{
+	struct shard *shard = data;
+	unsigned long seq = __atomic_load_n(&shard->pin_seq, __ATOMIC_ACQUIRE);
+	for(;;) {
+		unsigned long cur;
+		while ((cur = __atomic_load_n(&shard->pin_seq,
+					      __ATOMIC_ACQUIRE)) == seq)
+			cpu_relax();
+		seq = cur;
+
+		unsigned int bucket = phase_pick(shard);
+		__atomic_store_n(&shard->last_bucket, bucket, __ATOMIC_RELAXED);
+		char *mem = shard_page(shard, rng_next() % shard->nr_pages);
+		delay_ns(phase_offset_ns(shard, bucket));
+		mem[PAGE_SIZE-1] = 0;
+	}
+	return NULL;
+}
+
+/*
+ * Start generation seq: stamp the file blocks and the page blocks, and
+ * record both as the expected and the pre-read content the checker
+ * compares against.
+ */
+static void stamp_generation(struct shard *shard, unsigned long seq)
+{
+	unsigned int nr = shard->nr_pages;
+	shard->seq = seq;
+	for (unsigned int i = 0; i < nr; i++) {
+		char *page = shard_page(shard, i);
+		char *block = shard->stamp_buf + i * HARDBLKSIZE;
+		stamp_block(block, 0, STAMP_FILE, i, seq);
+		memcpy(page + PAGE_SIZE, block, HARDBLKSIZE);
+		stamp_block(page, 0xff, STAMP_MEMORY, i, seq);
+		memcpy(page + PAGE_SIZE*2, page, HARDBLKSIZE);
+	}
+	if (pwrite(shard->fd, shard->stamp_buf, nr * HARDBLKSIZE,
+		   shard->offset) != nr * HARDBLKSIZE)
+		perror("write stamp"), exit(1);
+}
+
+/* which generation the page holds and how long ago it was stamped */
+static void print_stamp(struct shard *shard, const char *page)
+{
+	struct stamp st;
+	memcpy(&st, page, sizeof(st));
+	if (st.source != STAMP_FILE && st.source != STAMP_MEMORY) {
+		printf("unstamped data (generation %lu): ", shard->seq);
+		return;
+	}
+	printf("holds generation %lu %s stamp of %.0fns ago, expected "
+	       "generation %lu file stamp: ", (unsigned long) st.seq,
+	       st.source == STAMP_FILE ? "file" : "memory",
+	       (double) (stamp_clock() - st.tsc) * stamp_ns_per_tick,
+	       shard->seq);
+}
+
+static void report(struct shard *shard, unsigned int page_idx,
+		   unsigned char class, bool skip_memset,
+		   unsigned long start, unsigned long end)
+{
+	char *page = shard_page(shard, page_idx);
+
+	if (nr_shards > 1)
+		printf("shard %u: ", shard->id);
+	if (shard->nr_pages > 1)
+		printf("page %u: ", page_idx);
+	if (phase) {
+		unsigned int bucket = __atomic_load_n(&shard->last_bucket,
+						      __ATOMIC_RELAXED);
+		__atomic_fetch_add(&shard->hits[bucket], 1, __ATOMIC_RELAXED);
+		printf("phase offset %luns: ", phase_offset_ns(shard, bucket));
+	}
+	if (stamp)
+		print_stamp(shard, page);
+	if (class == PAGE_STALE) {
+		printf("memory corruption detected\n");
+		return;
+	}
+	if (skip_memset)
+		printf("unexpected memory corruption detected, ");
+	else
+		printf("memory corruption detected, ");
+	/* the pin timing context of the read that missed */
+	printf("read took %luns, checked %luns later, diff:",
+	       end - start, now_ns() - end);
+	print_diff(page, page+PAGE_SIZE);
+}
+
+static void* reader(void *data)
+{
+	struct shard *shard = data;
+	unsigned int nr = shard->nr_pages;
+	ssize_t size = nr * HARDBLKSIZE;
+	int fd = shard->fd;
+
+	unsigned char *class = malloc(nr);
+	if (!class)
+		perror("malloc"), exit(1);
+
+	/* with stamps every read changes the page, no need to alternate */
+	bool skip_memset = !stamp;
+	unsigned long seq = 0;
+	while (1) {
+		if (stamp)
+			stamp_generation(shard, ++seq);
+		unsigned long start = now_ns();
+		if (phase)
+			__atomic_fetch_add(&shard->pin_seq, 1, __ATOMIC_RELEASE);
+		if (preadv(fd, shard->iov, nr, shard->offset) != size)
+			perror("read"), exit(1);
+		unsigned long end = now_ns();
+		if (phase) {
+			/* moving average of the pin lifetime */
+			unsigned long read_ns = shard->read_ns;
+			read_ns = (read_ns * 7 + end - start) / 8;
+			__atomic_store_n(&shard->read_ns, read_ns,
+					 __ATOMIC_RELAXED);
+		}
+		if (check_pages(shard->mem, nr, class)) {
+			flockfile(stdout);
+			for (unsigned int i = 0; i < nr; i++)
+				if (class[i] != PAGE_CLEAN)
+					report(shard, i, class[i], skip_memset,
+					       start, end);
+			funlockfile(stdout);
+		}
+		if (stamp)
+			continue;
+		skip_memset = !skip_memset;
+		if (!skip_memset)
+			for (unsigned int i = 0; i < nr; i++)
+				memset(shard_page(shard, i), 0xff, HARDBLKSIZE);
+	}
 	return NULL;
 }
 
 int main(int argc, char *argv[])
 {
-	if (argc < 2)
-		printf("%s <filename>\n", argv[0]), exit(1);
+	const char *filename = NULL;
+	bool use_ramdisk = false;
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--shards")) {
+			long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+			/* every shard keeps three threads busy */
+			nr_shards = cpus >= 3 ? cpus / 3 : 1;
+		} else if (!strncmp(argv[i], "--shards=", 9)) {
+			nr_shards = strtoul(argv[i] + 9, NULL, 0);
+			if (!nr_shards)
+				printf("invalid number of shards\n"), exit(1);
+		} else if (!strncmp(argv[i], "--pages=", 8)) {
+			nr_pages = strtoul(argv[i] + 8, NULL, 0);
+			if (!nr_pages || nr_pages > UIO_MAXIOV)
+				printf("invalid number of pages\n"), exit(1);
+		} else if (!strcmp(argv[i], "--ramdisk"))
+			use_ramdisk = true;
+		else if (!strncmp(argv[i], "--placement=", 12)) {
+			placement = placement_lookup(argv[i] + 12);
+			if (!placement)
+				printf("invalid placement\n"), exit(1);
+		} else if (!strcmp(argv[i], "--phase"))
+			phase = true;
+		else if (!strcmp(argv[i], "--stamp"))
+			stamp = true;
+		else if (!filename)
+			filename = argv[i];
+		else {
+			filename = NULL;
+			break;
+		}
+	}
+	if (!filename)
+		printf("%s [--shards[=N]] [--pages=N] [--phase] [--stamp] "
+		       "[--placement=smt|llc|cross-llc|cross-node] [--ramdisk] "
+		       "<filename>\n",
+		       argv[0]), exit(1);
 
 	char path[PAGE_SIZE];
 	strcpy(path, "/proc/");
 	sprintf(path + strlen(path), "%d", getpid());
 	strcat(path, "/clear_refs");
-	long soft_dirty_fd = open(path, O_WRONLY);
-	if (soft_dirty_fd < 0)
-		perror("open clear_refs"), exit(1);
-
-	char *mem;
-	if (posix_memalign((void **)&mem, PAGE_SIZE, PAGE_SIZE*3))
-		perror("posix_memalign"), exit(1);
-	/* THP is not using page_count so it would not corrupt memory */
-	if (madvise(mem, PAGE_SIZE, MADV_NOHUGEPAGE))
-		perror("madvise"), exit(1);
-	bzero(mem, PAGE_SIZE * 3);
-	memset(mem + PAGE_SIZE * 2, 0xff, HARDBLKSIZE);
 
 	/*
 	 * This is not specific to O_DIRECT. Even if O_DIRECT was
@@ -93,47 +518,106 @@ int main(int argc, char *argv[])
 	 * iov_iter_get_pages internally to create transient GUP pins
 	 * on anon memory.
 	 */
-	int fd = open(argv[1], O_DIRECT|O_CREAT|O_RDWR|O_TRUNC, 0600);
+	if (use_ramdisk) {
+		/* the zero blocks, or every shard its own stamped region */
+		unsigned long size = nr_pages * HARDBLKSIZE;
+		if (stamp)
+			size *= nr_shards;
+		filename = ramdisk(filename, size);
+	}
+	int fd = open(filename, O_DIRECT|O_CREAT|O_RDWR|O_TRUNC, 0600);
 	if (fd < 0)
 		perror("open"), exit(1);
-	if (write(fd, mem, PAGE_SIZE) != PAGE_SIZE)
-		perror("write"), exit(1);
 
-	pthread_t soft_dirty;
-	if (pthread_create(&soft_dirty, NULL,
-			   background_soft_dirty, (void *)soft_dirty_fd))
-		perror("pthread_create soft_dirty"), exit(1);
+	struct shard *shards = calloc(nr_shards, sizeof(*shards));
+	if (!shards)
+		perror("calloc"), exit(1);
 
-	pthread_t thread;
-	if (pthread_create(&thread, NULL, writer, mem))
-		perror("pthread_create writer"), exit(1);
+	for (unsigned int i = 0; i < nr_shards; i++) {
+		struct shard *shard = &shards[i];
+		shard->id = i;
 
-	bool skip_memset = true;
-	while (1) {
-		if (pread(fd, mem, HARDBLKSIZE, 0) != HARDBLKSIZE)
-			perror("read"), exit(1);
-		if (memcmp(mem, mem+PAGE_SIZE, HARDBLKSIZE)) {
-			if (memcmp(mem, mem+PAGE_SIZE*2, PAGE_SIZE)) {
-				if (skip_memset)
-					printf("unexpected memory "
-					       "corruption detected\n");
-				else
-					printf("memory corruption detected, "
-					       "dumping page\n");
-				int end = PAGE_SIZE;
-				if (!memcmp(mem+HARDBLKSIZE, mem+PAGE_SIZE,
-					    PAGE_SIZE-HARDBLKSIZE))
-					end = HARDBLKSIZE;
-				for (int i = 0; i < end; i++)
-					printf("%x", mem[i]);
-				printf("\n");
-			} else
-				printf("memory corruption detected\n");
+		shard->soft_dirty_fd = open(path, O_WRONLY);
+		if (shard->soft_dirty_fd < 0)
+			perror("open clear_refs"), exit(1);
+
+		char *mem;
+		size_t size = PAGE_SIZE*3 * nr_pages;
+		if (posix_memalign((void **)&mem, PAGE_SIZE, size))
+			perror("posix_memalign"), exit(1);
+		/* THP is not using page_count so it would not corrupt memory */
+		if (madvise(mem, size, MADV_NOHUGEPAGE))
+			perror("madvise"), exit(1);
+		bzero(mem, size);
+		shard->mem = mem;
+		shard->nr_pages = nr_pages;
+		shard->iov = calloc(nr_pages, sizeof(*shard->iov));
+		if (!shard->iov)
+			perror("calloc"), exit(1);
+		for (unsigned int j = 0; j < nr_pages; j++) {
+			char *page = shard_page(shard, j);
+			memset(page + PAGE_SIZE * 2, 0xff, HARDBLKSIZE);
+			shard->iov[j].iov_base = page;
+			shard->iov[j].iov_len = HARDBLKSIZE;
+		}
+		if (stamp) {
+			/* O_DIRECT needs an aligned source too */
+			if (posix_memalign((void **)&shard->stamp_buf,
+					   PAGE_SIZE, nr_pages * HARDBLKSIZE))
+				perror("posix_memalign"), exit(1);
+			shard->offset = (off_t) i * nr_pages * HARDBLKSIZE;
+		}
+
+		if (!i) {
+			/* one zero block per page, read back by preadv */
+			for (unsigned int j = 0;
+			     j < nr_pages; j += PAGE_SIZE / HARDBLKSIZE)
+				if (write(fd, mem + PAGE_SIZE,
+					  PAGE_SIZE) != PAGE_SIZE)
+					perror("write"), exit(1);
+			shard->fd = fd;
+		} else {
+			/* every reader gets its own O_DIRECT file descriptor */
+			shard->fd = open(filename, O_DIRECT|O_RDWR);
+			if (shard->fd < 0)
+				perror("open"), exit(1);
+		}
+	}
+	if (nr_shards > 1)
+		printf("Racing %u shards\n", nr_shards);
+
+	delay_calibrate();
+	if (stamp)
+		stamp_calibrate();
+	checker_init();
+	if (placement)
+		topo_init();
+
+	for (unsigned int i = 0; i < nr_shards; i++) {
+		struct shard *shard = &shards[i];
+
+		if (pthread_create(&shard->soft_dirty, NULL,
+				   background_soft_dirty,
+				   (void *)shard->soft_dirty_fd))
+			perror("pthread_create soft_dirty"), exit(1);
+
+		if (pthread_create(&shard->writer, NULL,
+				   phase ? phase_writer : writer, shard))
+			perror("pthread_create writer"), exit(1);
+
+		if (pthread_create(&shard->reader, NULL, reader, shard))
+			perror("pthread_create reader"), exit(1);
+
+		if (placement) {
+			char group[32];
+			snprintf(group, sizeof(group), "shard=%u", i);
+			place(group, shard->reader, shard->writer,
+			      shard->soft_dirty);
 		}
-		skip_memset = !skip_memset;
-		if (!skip_memset)
-			memset(mem, 0xff, HARDBLKSIZE);
 	}
 
+	for (unsigned int i = 0; i < nr_shards; i++)
+		pthread_join(shards[i].reader, NULL);
+
 	return 0;
 }
@@ -0,0 +1,448 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ *  time-to-detection harness for the reproducers in this directory.
+ *
+ *  Copyright (C) 2021  Red Hat, Inc.
+ *
+ *  gcc -O2 -o ttd_harness ttd_harness.c -lm
+ *
+ *  ./ttd_harness run [--runs=N] [--deadline=SEC] [--match=STRING]...
+ *	[--baseline=<csv>] [--ratio=R] [--alpha=A] [--beta=B]
+ *	-- ./page_count_do_wp_page ./whateverfile >kernel-x.csv
+ *  ./ttd_harness compare kernel-x.csv kernel-y.csv
+ *
+ *  "run" starts the reproducer --runs times (default 20), each time
+ *  in its own process group, and kills it once a line of its output
+ *  contains one of the --match strings or after --deadline seconds
+ *  (default 600). The default match strings are "memory corruption
+ *  detected" and "THIS IS SECRET", which cover all reproducers here;
+ *  vmsplice-oom or the tracers need an explicit --match. The output
+ *  is read through a pseudo terminal, so the reproducers keep their
+ *  stdout line buffered. Each run is printed as one CSV record:
+ *
+ *	kernel,program,run,detected,seconds
+ *
+ *  where detected is 0 for runs censored by the deadline or by the
+ *  program exiting on its own.
+ *
+ *  With --baseline the runs are also fed into two Wald sequential
+ *  probability ratio tests against the detection rate of the baseline
+ *  records, modelling time-to-detection as exponential with censoring.
+ *  One tests for a rate --ratio times lower (fixed), the other for a
+ *  rate --ratio times higher (regressed). The harness stops as soon as
+ *  both tests reach a decision, with error rates --alpha and --beta
+ *  (default 0.05), so a verdict takes as few runs as the data allows.
+ *
+ *  "compare" prints the Kaplan-Meier survival curves of two sets of
+ *  records, their median time-to-detection and a log-rank test of
+ *  whether they differ.
+ */
+
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <math.h>
+#include <termios.h>
+#include <sys/wait.h>
+#include <sys/utsname.h>
+
+#define MAX_MATCH 16
+#define LINE_SIZE 4096
+
+struct record {
+	bool detected;
+	double seconds;
+};
+
+struct records {
+	struct record *rec;
+	unsigned long nr, alloc;
+};
+
+static void records_add(struct records *r, bool detected, double seconds)
+{
+	if (r->nr == r->alloc) {
+		r->alloc = r->alloc ? r->alloc * 2 : 64;
+		r->rec = realloc(r->rec, r->alloc * sizeof(*r->rec));
+		if (!r->rec)
+			perror("realloc"), exit(1);
+	}
+	r->rec[r->nr].detected = detected;
+	r->rec[r->nr].seconds = seconds;
+	r->nr++;
+}
+
+static void records_load(const char *path, struct records *r)
+{
+	FILE *file = fopen(path, "r");
+	if (!file)
+		perror(path), exit(1);
+
+	char *line = NULL;
+	size_t len = 0;
+	while (getline(&line, &len, file) > 0) {
+		int detected;
+		double seconds;
+		/* kernel,program,run,detected,seconds */
+		if (sscanf(line, "%*[^,],%*[^,],%*u,%d,%lf",
+			   &detected, &seconds) == 2)
+			records_add(r, detected, seconds);
+	}
+	free(line);
+	fclose(file);
+	if (!r->nr)
+		fprintf(stderr, "%s: no records\n", path), exit(1);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void kill_group(pid_t pid)
+{
+	/* SIGTERM first so the cgroup sandboxes can clean up */
+	kill(-pid, SIGTERM);
+	for (int i = 0; i < 200; i++) {
+		if (waitpid(pid, NULL, WNOHANG) == pid)
+			break;
+		usleep(10000);
+	}
+	kill(-pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+}
+
+/*
+ * The output of the program goes to a pseudo terminal rather than a
+ * pipe, so its stdio is line buffered and a detection is seen when it
+ * is printed, not when a full buffer is flushed. The terminal is raw
+ * so the lines are not rewritten with CR LF.
+ */
+static int open_pty(int *slave)
+{
+	int master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master < 0 || grantpt(master) || unlockpt(master))
+		perror("posix_openpt"), exit(1);
+	*slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+	if (*slave < 0)
+		perror("open pty"), exit(1);
+	struct termios tio;
+	if (tcgetattr(*slave, &tio))
+		perror("tcgetattr"), exit(1);
+	cfmakeraw(&tio);
+	if (tcsetattr(*slave, TCSANOW, &tio))
+		perror("tcsetattr"), exit(1);
+	return master;
+}
+
+/*
+ * Run the program once and return the seconds until one of the match
+ * strings showed up in its output, or a negative value if it did not
+ * before the deadline or before it exited.
+ */
+static double run_once(char **argv, double deadline, char **match,
+		       int nr_match, double *elapsed)
+{
+	int slave, master = open_pty(&slave);
+
+	double start = now();
+	pid_t pid = fork();
+	if (pid < 0)
+		perror("fork"), exit(1);
+	if (!pid) {
+		setpgid(0, 0);
+		close(master);
+		if (dup2(slave, STDOUT_FILENO) < 0 ||
+		    dup2(slave, STDERR_FILENO) < 0)
+			perror("dup2"), exit(1);
+		close(slave);
+		execvp(argv[0], argv);
+		perror("execvp"), exit(1);
+	}
+	setpgid(pid, pid);
+	close(slave);
+
+	char line[LINE_SIZE];
+	size_t len = 0;
+	double found = -1;
+	struct pollfd pfd = { .fd = master, .events = POLLIN };
+	for (;;) {
+		double left = deadline - (now() - start);
+		if (left <= 0)
+			break;
+		int ret = poll(&pfd, 1, left * 1000 + 1);
+		if (ret < 0 && errno != EINTR)
+			perror("poll"), exit(1);
+		if (ret <= 0)
+			continue;
+
+		ssize_t n = read(master, line + len, sizeof(line) - len - 1);
+		/* EIO once the last writer of the terminal is gone */
+		if (!n || (n < 0 && errno == EIO))
+			break;
+		if (n < 0 && errno != EINTR)
+			perror("read"), exit(1);
+		if (n < 0)
+			continue;
+		len += n;
+		line[len] = 0;
+
+		/* scan complete lines, keep the partial tail */
+		char *p = line, *nl;
+		while ((nl = strchr(p, '\n'))) {
+			*nl = 0;
+			for (int i = 0; i < nr_match; i++)
+				if (strstr(p, match[i]))
+					found = now() - start;
+			p = nl + 1;
+			if (found >= 0)
+				break;
+		}
+		if (found >= 0)
+			break;
+		len = strlen(p);
+		if (len == sizeof(line) - 1)
+			len = 0;
+		memmove(line, p, len);
+	}
+	*elapsed = now() - start;
+	kill_group(pid);
+	close(master);
+	return found;
+}
+
+/* exponential rate of detections per second, events over exposure */
+static double detection_rate(struct records *r)
+{
+	double events = 0, exposure = 0;
+	for (unsigned long i = 0; i < r->nr; i++) {
+		events += r->rec[i].detected;
+		exposure += r->rec[i].seconds;
+	}
+	/* keep a never detecting baseline comparable */
+	if (!events)
+		events = 0.5;
+	return events / exposure;
+}
+
+static int cmd_run(int argc, char *argv[])
+{
+	unsigned long runs = 20;
+	double deadline = 600, ratio = 4, alpha = 0.05, beta = 0.05;
+	char *match[MAX_MATCH], *baseline = NULL;
+	int nr_match = 0, i;
+
+	for (i = 0; i < argc; i++) {
+		if (!strcmp(argv[i], "--")) {
+			i++;
+			break;
+		}
+		if (!strncmp(argv[i], "--runs=", 7))
+			runs = strtoul(argv[i] + 7, NULL, 0);
+		else if (!strncmp(argv[i], "--deadline=", 11))
+			deadline = strtod(argv[i] + 11, NULL);
+		else if (!strncmp(argv[i], "--match=", 8)) {
+			if (nr_match == MAX_MATCH)
+				fprintf(stderr, "too many --match\n"), exit(1);
+			match[nr_match++] = argv[i] + 8;
+		} else if (!strncmp(argv[i], "--baseline=", 11))
+			baseline = argv[i] + 11;
+		else if (!strncmp(argv[i], "--ratio=", 8))
+			ratio = strtod(argv[i] + 8, NULL);
+		else if (!strncmp(argv[i], "--alpha=", 8))
+			alpha = strtod(argv[i] + 8, NULL);
+		else if (!strncmp(argv[i], "--beta=", 7))
+			beta = strtod(argv[i] + 7, NULL);
+		else
+			return -1;
+	}
+	if (i >= argc || !runs || deadline <= 0 || ratio <= 1 ||
+	    alpha <= 0 || alpha >= 1 || beta <= 0 || beta >= 1)
+		return -1;
+	char **prog = argv + i;
+	if (!nr_match) {
+		match[nr_match++] = "memory corruption detected";
+		match[nr_match++] = "THIS IS SECRET";
+	}
+
+	double rate0 = 0;
+	if (baseline) {
+		struct records base = { 0 };
+		records_load(baseline, &base);
+		rate0 = detection_rate(&base);
+		free(base.rec);
+		fprintf(stderr, "baseline rate %g/s\n", rate0);
+	}
+	/* Wald boundaries on the log likelihood ratio */
+	double accept_h1 = log((1 - beta) / alpha);
+	double accept_h0 = log(beta / (1 - alpha));
+	double llr_fixed = 0, llr_regressed = 0;
+	const char *fixed = NULL, *regressed = NULL;
+
+	struct utsname uts;
+	if (uname(&uts))
+		perror("uname"), exit(1);
+	const char *name = strrchr(prog[0], '/');
+	name = name ? name + 1 : prog[0];
+
+	printf("kernel,program,run,detected,seconds\n");
+	fflush(stdout);
+	for (unsigned long run = 0; run < runs; run++) {
+		double elapsed;
+		double found = run_once(prog, deadline, match, nr_match,
+					&elapsed);
+		bool detected = found >= 0;
+		double seconds = detected ? found : elapsed;
+		printf("%s,%s,%lu,%d,%.6f\n", uts.release, name, run,
+		       detected, seconds);
+		fflush(stdout);
+
+		if (!baseline)
+			continue;
+		/* exponential log likelihood: d*log(rate) - rate*t */
+		double rate1 = rate0 / ratio;
+		llr_fixed += detected * log(rate1 / rate0) -
+			(rate1 - rate0) * seconds;
+		rate1 = rate0 * ratio;
+		llr_regressed += detected * log(rate1 / rate0) -
+			(rate1 - rate0) * seconds;
+
+		if (!fixed && llr_fixed >= accept_h1)
+			fixed = "yes";
+		else if (!fixed && llr_fixed <= accept_h0)
+			fixed = "no";
+		if (!regressed && llr_regressed >= accept_h1)
+			regressed = "yes";
+		else if (!regressed && llr_regressed <= accept_h0)
+			regressed = "no";
+		if (fixed && regressed)
+			break;
+	}
+	if (baseline) {
+		const char *verdict = "inconclusive";
+		if (fixed && regressed) {
+			if (!strcmp(fixed, "yes"))
+				verdict = "fixed";
+			else if (!strcmp(regressed, "yes"))
+				verdict = "regressed";
+			else
+				verdict = "unchanged";
+		}
+		fprintf(stderr, "sprt verdict=%s llr_fixed=%.3f "
+			"llr_regressed=%.3f\n", verdict, llr_fixed,
+			llr_regressed);
+	}
+	return 0;
+}
+
+static int record_cmp(const void *_a, const void *_b)
+{
+	const struct record *a = _a, *b = _b;
+	if (a->seconds != b->seconds)
+		return a->seconds < b->seconds ? -1 : 1;
+	/* events before censoring at the same time */
+	return b->detected - a->detected;
+}
+
+/* Kaplan-Meier estimate, returns the median time or -1 if not reached */
+static double kaplan_meier(const char *name, struct records *r)
+{
+	double survival = 1, median = -1;
+	unsigned long at_risk = r->nr;
+
+	qsort(r->rec, r->nr, sizeof(*r->rec), record_cmp);
+	printf("# %s: %lu runs\n# seconds survival at_risk\n", name, r->nr);
+	for (unsigned long i = 0; i < r->nr;) {
+		double t = r->rec[i].seconds;
+		unsigned long events = 0, gone = 0;
+		for (; i < r->nr && r->rec[i].seconds == t; i++, gone++)
+			events += r->rec[i].detected;
+		if (events) {
+			survival *= 1 - (double) events / at_risk;
+			printf("%.6f %.4f %lu\n", t, survival, at_risk);
+			if (median < 0 && survival <= 0.5)
+				median = t;
+		}
+		at_risk -= gone;
+	}
+	return median;
+}
+
+/* log-rank statistic, chi-square with one degree of freedom */
+static double log_rank(struct records *a, struct records *b)
+{
+	double observed = 0, expected = 0, variance = 0;
+	unsigned long ia = 0, ib = 0;
+
+	while (ia < a->nr || ib < b->nr) {
+		double t;
+		if (ib >= b->nr || (ia < a->nr &&
+				    a->rec[ia].seconds <= b->rec[ib].seconds))
+			t = a->rec[ia].seconds;
+		else
+			t = b->rec[ib].seconds;
+
+		double na = a->nr - ia, nb = b->nr - ib;
+		double da = 0, db = 0;
+		for (; ia < a->nr && a->rec[ia].seconds == t; ia++)
+			da += a->rec[ia].detected;
+		for (; ib < b->nr && b->rec[ib].seconds == t; ib++)
+			db += b->rec[ib].detected;
+
+		double n = na + nb, d = da + db;
+		if (!d)
+			continue;
+		observed += da;
+		expected += d * na / n;
+		if (n > 1)
+			variance += d * (na / n) * (nb / n) * (n - d) / (n - 1);
+	}
+	if (!variance)
+		return 0;
+	return (observed - expected) * (observed - expected) / variance;
+}
+
+static int cmd_compare(int argc, char *argv[])
+{
+	if (argc != 2)
+		return -1;
+
+	struct records a = { 0 }, b = { 0 };
+	records_load(argv[0], &a);
+	records_load(argv[1], &b);
+
+	double median_a = kaplan_meier(argv[0], &a);
+	double median_b = kaplan_meier(argv[1], &b);
+	double chi2 = log_rank(&a, &b);
+	double p = erfc(sqrt(chi2 / 2));
+
+	printf("median_a=%.6f median_b=%.6f rate_a=%g/s rate_b=%g/s "
+	       "logrank_chi2=%.4f p=%.6f\n", median_a, median_b,
+	       detection_rate(&a), detection_rate(&b), chi2, p);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int ret = -1;
+	if (argc >= 2 && !strcmp(argv[1], "run"))
+		ret = cmd_run(argc - 2, argv + 2);
+	else if (argc >= 2 && !strcmp(argv[1], "compare"))
+		ret = cmd_compare(argc - 2, argv + 2);
+	if (ret)
+		printf("%s run [--runs=N] [--deadline=SEC] [--match=STRING]... "
+		       "[--baseline=<csv>] [--ratio=R] [--alpha=A] [--beta=B] "
+		       "-- <program> [args...]\n"
+		       "%s compare <csv> <csv>\n", argv[0], argv[0]), exit(1);
+	return 0;
+}
@@ -13,12 +13,34 @@
  *  echo 1234 1111 >/sys/bus/pci/drivers/vfio-pci/new_id
  *
  *  gcc -O2 -o vfio_swap vfio_swap.c -lpthread
- *  ./vfio_swap 0000:00:01.0
+ *  ./vfio_swap [--cgroup[=MiB]] [--psi[=PCT]] [--stats=<file>] \
+ *	[--interval=SEC] 0000:00:01.0
+ *
+ *  --cgroup runs the reproducer inside its own cgroup v2 with a
+ *  memory.max of MiB (default 256) and only applies swap pressure
+ *  inside it, instead of swapping the whole host. It requires root
+ *  and the cgroup v2 hierarchy mounted at /sys/fs/cgroup.
+ *
+ *  --psi replaces the swap churn region with a feedback controller
+ *  that grows and shrinks a persistent hog to hold the memory pressure
+ *  stall time (PSI "some", of the cgroup with --cgroup) at PCT percent
+ *  (default 10), so the race page keeps cycling through the swap cache
+ *  without livelocking the box. It prints the measured pressure, the
+ *  hog size and the swap-in/out rates every second. It requires
+ *  CONFIG_PSI.
+ *
+ *  Progress is reported every --interval seconds (default 1) from
+ *  per-thread counters, including the MiB/s the swap churn region
+ *  pushes out; --stats=<file> places the counters in a shared file
+ *  mapping other processes can sample.
  *
  *  Run concurrently with kprobes introduced via bpftrace:
  *
  * bpftrace -e 'kprobe:vfio_pin_pages_remote { @vfio_start[tid] = arg1; } kretprobe:vfio_pin_pages_remote { @vfio_pinned[tid] = retval; } kprobe:wp_page_copy /@vfio_pinned[tid] > 0/ { $x = (struct vm_fault *)arg0; $addr = $x->address; if ($addr >= @vfio_start[tid] && $addr < @vfio_start[tid] + @vfio_pinned[tid] * 4096) { printf("bug\n"); } } kprobe:vfio_unmap_unpin /@vfio_pinned[tid]/ { delete(@vfio_pinned[tid]); }'
  *
+ * or with ./page_count_do_wp_page-tracer, which streams the same
+ * detections live as COW_after_vfio_pin records.
+ *
  * Fixed in https://github.com/aagit/aa/tree/mapcount_unshare
  *
  * To verify: bpftrace -e 'kprobe:vfio_pin_pages_remote { @vfio_start[tid] = arg1; } kretprobe:vfio_pin_pages_remote { @vfio_pinned[tid] = retval; } kprobe:__wp_page_copy /@vfio_pinned[tid] > 0/ { $x = (struct vm_fault *)arg0; $addr = $x->address; if ($addr >= @vfio_start[tid] && $addr < @vfio_start[tid] + @vfio_pinned[tid] * 4096) { printf("bug\n"); } } kprobe:vfio_unmap_unpin /@vfio_pinned[tid]/ { delete(@vfio_pinned[tid]); }'
@@ -33,14 +55,20 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <stdint.h>
+#include <time.h>
+#include <sys/prctl.h>
 #include <sys/errno.h>
 #include <sys/syscall.h>
 #include <sys/mman.h>
 
+#include <signal.h>
+#include <limits.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <sys/ioctl.h>
 #include <linux/ioctl.h>
 #include <linux/vfio.h>
+#include "page_count_do_wp_page-common.h"
 
 #define PAGE_SIZE (1UL<<12)
 /*
@@ -48,29 +76,27 @@
  * corruption with an HARDBLKSIZE of 4k or more.
  */
 #define HARDBLKSIZE 512
+#define CGROUP_DEFAULT_MAX (256UL<<20)
 
 static void* background_pageout(void *_mem)
 {
 	char *mem = (char *)_mem;
+	struct thread_stats *st = stats_register("pageout");
 	for(;;) {
-		usleep(random() % 1000);
+		random_delay_us(1000);
 		madvise(mem, PAGE_SIZE, MADV_PAGEOUT);
+		stat_inc(&st->pageouts);
 	}
 	return NULL;
 }
 
 static void* background_swap(void *_size)
 {
-	unsigned long size = (unsigned long) _size;
-	for (;;) {
-		volatile char *p = malloc(size);
-		if (!p)
-			perror("malloc"), exit(1);
-		for (unsigned long i = 0; i < size; i += PAGE_SIZE) {
-			p[i] = 0;
-		}
-		free((void *)p);
-	}
+	struct thread_stats *st = stats_register("churn");
+	struct swap_churn churn;
+	churn_init(&churn, (unsigned long) _size);
+	for (;;)
+		stat_add(&st->churned, churn_step(&churn) / PAGE_SIZE);
 	return NULL;
 }
 
@@ -217,9 +243,42 @@ static int dma_unmap(int container, int size, unsigned long iova)
 
 int main(int argc, char *argv[])
 {
-	if (argc < 2)
-		printf("%s <PCI device (xxxx:xx:xx.x)>\n",
-		       argv[0]), exit(1);
+	char *device_name = NULL, *stats_path = NULL;
+	double psi_target = 0;
+	unsigned long cgroup_max = 0, interval = 1;
+	for (int i = 1; i < argc; i++) {
+		if (!strncmp(argv[i], "--stats=", 8))
+			stats_path = argv[i] + 8;
+		else if (!strncmp(argv[i], "--interval=", 11)) {
+			interval = strtoul(argv[i] + 11, NULL, 0);
+			if (!interval)
+				printf("invalid interval\n"), exit(1);
+		} else if (!strcmp(argv[i], "--psi"))
+			psi_target = 10;
+		else if (!strncmp(argv[i], "--psi=", 6)) {
+			psi_target = strtod(argv[i] + 6, NULL);
+			if (psi_target <= 0 || psi_target >= 100)
+				printf("invalid psi target\n"), exit(1);
+		} else if (!strcmp(argv[i], "--cgroup"))
+			cgroup_max = CGROUP_DEFAULT_MAX;
+		else if (!strncmp(argv[i], "--cgroup=", 9)) {
+			cgroup_max = strtoul(argv[i] + 9, NULL, 0) << 20;
+			if (!cgroup_max)
+				printf("invalid cgroup size\n"), exit(1);
+		} else if (!device_name)
+			device_name = argv[i];
+		else {
+			device_name = NULL;
+			break;
+		}
+	}
+	if (!device_name)
+		printf("%s [--cgroup[=MiB]] [--psi[=PCT]] [--stats=<file>] "
+		       "[--interval=SEC] "
+		       "<PCI device (xxxx:xx:xx.x)>\n", argv[0]), exit(1);
+
+	if (cgroup_max)
+		cgroup_sandbox("vfio_swap", cgroup_max);
 
 	char *mem;
 	if (posix_memalign((void **)&mem, PAGE_SIZE, PAGE_SIZE*3))
@@ -232,39 +291,26 @@ int main(int argc, char *argv[])
 	bzero(mem, PAGE_SIZE * 3);
 	memset(mem + PAGE_SIZE * 2, 0xff, HARDBLKSIZE);
 
-	FILE *file = fopen("/proc/meminfo", "r");
-	if (!file)
-		perror("fopen meminfo"), exit(1);
-
-	char *line = NULL;
-	size_t len = 0;
-	unsigned long mem_total = 0, mem_avail = 0, swap_total = 0, swap_free = 0;
-	int match = 0;
-	while (getline(&line, &len, file) > 0) {
-		if (sscanf(line, "MemTotal: %lu kB", &mem_total))
-			match++;
-		if (sscanf(line, "MemAvailable: %lu kB", &mem_avail))
-			match++;
-		if (sscanf(line, "SwapTotal: %lu kB", &swap_total))
-			match++;
-		if (sscanf(line, "SwapFree: %lu kB", &swap_free)) {
-			match++;
-			break;
-		}
-	}
+	struct meminfo mi;
+	if (!meminfo_read(&mi))
+		fprintf(stderr, "/proc/meminfo error\n"), exit(1);
 
 	/* Consume an additional 1 GiB */
-	unsigned long size_kb = mem_total + 1024*1024;
+	unsigned long size_kb = mi.mem_total + 1024*1024;
+	/* or twice memory.max to keep reclaim busy inside the cgroup */
+	if (cgroup_max) {
+		size_kb = cgroup_max * 2 / 1024;
+		mi.mem_avail = cgroup_max / 1024;
+	}
 
-	if (match != 4 || swap_free > swap_total)
-		fprintf(stderr, "/proc/meminfo error\n"), exit(1);
-	if (!swap_total || !swap_free || swap_free < size_kb - mem_avail)
+	if (!mi.swap_total || !mi.swap_free ||
+	    mi.swap_free < size_kb - mi.mem_avail)
 		fprintf(stderr, "not enough swap\n"), exit(1);
 
 	unsigned long size = size_kb * 1024;
 	printf("Will allocate %lu MiB in order to swap\n", size / 1024 / 1024);
 
-	int group = get_group(argv[1]);
+	int group = get_group(device_name);
 	if (group < 0)
 		perror("get_group"), exit(1);
 
@@ -279,40 +325,56 @@ int main(int argc, char *argv[])
 	if (container_set_iommu(container))
 		perror("container_set_iommu"), exit(1);
 
-	int device = group_get_device(group, argv[1]);
+	int device = group_get_device(group, device_name);
 	if (device < 0)
 		perror("group_get_device"), exit(1);
 
+	stats_init(stats_path);
+	delay_calibrate();
+
+	pthread_t reporter;
+	if (pthread_create(&reporter, NULL, stats_reporter, (void *)interval))
+		perror("pthread_create reporter"), exit(1);
+
 	pthread_t pageout;
 	if (pthread_create(&pageout, NULL, background_pageout, mem))
 		perror("pthread_create pageout"), exit(1);
 
 	pthread_t swap;
-	if (pthread_create(&swap, NULL, background_swap, (void *)size))
+	if (psi_target) {
+		static struct psi_controller psi;
+		psi_init(&psi, psi_target, size,
+			 cgroup_max ? sandbox_dir : NULL);
+		if (pthread_create(&swap, NULL, background_psi, &psi))
+			perror("pthread_create psi"), exit(1);
+	} else if (pthread_create(&swap, NULL, background_swap, (void *)size))
 		perror("pthread_create swap"), exit(1);
 
-	static unsigned long count;
-
+	struct thread_stats *st = stats_register("mapper");
+	unsigned long start;
 	char x;
 	volatile char *mem2 = (char *)mem;
-	printf("VFIO mapping loop"), fflush(stdout);
+	printf("VFIO mapping loop\n"), fflush(stdout);
 	while (1) {
-		if (!(++count % 1000))
-			printf("."), fflush(stdout);
+		stat_inc(&st->attempts);
 
-		usleep(random() % 1000);
+		random_delay_us(1000);
 		x = mem2[PAGE_SIZE-1];
+		start = now_ns();
 		if (dma_map(container, mem, PAGE_SIZE, 1<<20)) {
 			fprintf(stderr, "dma_map() failed\n");
 			exit(-1);
 		}
+		stat_latency(st->pin_hist, start);
 
 		mem2[PAGE_SIZE-1] = x;
 
+		start = now_ns();
 		if (dma_unmap(container, PAGE_SIZE, 1<<20) != PAGE_SIZE) {
 			fprintf(stderr, "dma_unmap() failed\n");
 			exit(-1);
 		}
+		stat_latency(st->unpin_hist, start);
 	}
 
 	return 0;
@@ -6,6 +6,13 @@
  * Note that you need at least two hugetlb pages, for example, via:
  *   echo 2 > /sys/devices/system/node/node0/hugepages/hugepages-2048kB/nr_hugepages
  *
+ * Parent and child are ordered with pipes instead of sleeps, so the
+ * fork -> vmsplice -> munmap -> parent write -> read cycle can be
+ * repeated in a loop:
+ *   ./vmsplice-hugetlb-v5.11 [cycles]
+ * With more than one cycle it reports the cycle latency and how many
+ * cycles leaked the parent data.
+ *
  * Fixed in https://gitlab.com/aarcange/aa/-/tree/mapcount_unshare
  */
 
@@ -14,7 +21,9 @@
 #include <fcntl.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <err.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/uio.h>
 #include <sys/mman.h>
@@ -28,39 +37,98 @@
   __res;                      \
 })
 
+#define SECRET "THIS IS SECRET"
+
 static void *data;
+static int ready_fds[2], written_fds[2];
 
-static void child_fn(void) {
+static void child_fn(bool verbose) {
   int pipe_fds[2];
+  char c = 0;
   SYSCHK(pipe(pipe_fds));
   struct iovec iov = {.iov_base = data, .iov_len = 2*1024*1024 };
   SYSCHK(vmsplice(pipe_fds[1], &iov, 1, 0));
   SYSCHK(munmap(data, 2*1024*1024));
-  sleep(2);
-  char buf[2*1024*1024];
-  SYSCHK(read(pipe_fds[0], buf, 2*1024*1024));
-  printf("read string from child: %s\n", buf);
+  SYSCHK(write(ready_fds[1], &c, 1));
+  SYSCHK(read(written_fds[0], &c, 1));
+  char buf[64];
+  SYSCHK(read(pipe_fds[0], buf, sizeof(buf)));
+  buf[sizeof(buf)-1] = 0;
+  if (verbose)
+    printf("read string from child: %s\n", buf), fflush(stdout);
+  _exit(!strcmp(buf, SECRET) ? 2 : 0);
+}
+
+static unsigned long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec;
 }
 
-int main(void) {
+/* returns true if the child read the data written after the fork */
+static bool cycle(bool verbose) {
+  char c;
   data = mmap(NULL, 2*1024*1024, PROT_READ|PROT_WRITE,
               MAP_ANONYMOUS|MAP_PRIVATE|MAP_HUGETLB, -1, 0);
   if (data == MAP_FAILED) {
     perror("mmap(MAP_HUGETLB) failed");
-    return -errno;
+    exit(-errno);
   }
 
   strcpy(data, "BORING DATA");
 
+  fflush(stdout);
+  /* a pipe per cycle, so EOF tells a child that failed early */
+  SYSCHK(pipe(ready_fds));
   pid_t child = SYSCHK(fork());
   if (child == 0) {
-    child_fn();
-    return 0;
+    close(ready_fds[0]);
+    child_fn(verbose);
   }
+  close(ready_fds[1]);
 
-  sleep(1);
-  strcpy(data, "THIS IS SECRET");
+  if (!SYSCHK(read(ready_fds[0], &c, 1)))
+    errx(1, "child failed");
+  close(ready_fds[0]);
+  strcpy(data, SECRET);
+  SYSCHK(write(written_fds[1], &c, 1));
 
   int status;
-  SYSCHK(wait(&status));
+  SYSCHK(waitpid(child, &status, 0));
+  SYSCHK(munmap(data, 2*1024*1024));
+  if (!WIFEXITED(status) || (WEXITSTATUS(status) & ~2))
+    errx(1, "child failed");
+  return WEXITSTATUS(status) == 2;
+}
+
+static int cmp_ulong(const void *a, const void *b) {
+  unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+  return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[]) {
+  unsigned long cycles = argc > 1 ? strtoul(argv[1], NULL, 0) : 1;
+  if (argc > 2 || !cycles)
+    errx(1, "usage: %s [cycles]", argv[0]);
+  SYSCHK(pipe(written_fds));
+
+  unsigned long *lat = calloc(cycles, sizeof(*lat));
+  if (!lat)
+    errx(1, "calloc()");
+  unsigned long leaks = 0, start = now_ns();
+  for (unsigned long i = 0; i < cycles; i++) {
+    unsigned long t = now_ns();
+    if (cycle(cycles == 1) && !leaks++ && cycles > 1)
+      printf("read string from child: %s (cycle %lu)\n", SECRET, i);
+    lat[i] = now_ns() - t;
+  }
+  if (cycles == 1)
+    return 0;
+
+  unsigned long total = now_ns() - start;
+  qsort(lat, cycles, sizeof(*lat), cmp_ulong);
+  printf("cycles=%lu leaks=%lu rate=%.0f/s p50=%luns p99=%luns max=%luns\n",
+         cycles, leaks, cycles * 1e9 / total, lat[cycles / 2],
+         lat[cycles * 99 / 100], lat[cycles - 1]);
+  return 0;
 }
